@@ -0,0 +1,428 @@
+#include "corobus.h"
+#include "corobus_mt.h"
+#include "libcoro.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Benchmarks of the channels. Each scenario prints the message
+ * rate, and the latency percentiles when the messages carry send
+ * time. A message can hold only 32 bits, so the time is the low
+ * bits of the monotonic clock in nanoseconds. That wraps in 4
+ * seconds, far more than any latency here.
+ *
+ * Usage: ./bench [message_count]
+ */
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline unsigned
+bench_stamp(void)
+{
+	return (unsigned)bench_now();
+}
+
+static inline unsigned
+bench_latency(unsigned stamp)
+{
+	return (unsigned)bench_now() - stamp;
+}
+
+struct bench_result {
+	/** Messages delivered. */
+	uint64_t count;
+	uint64_t start;
+	uint64_t end;
+	/** Latency samples, one per delivered message, or none. */
+	unsigned *lat;
+	size_t lat_count;
+};
+
+static void
+bench_result_create(struct bench_result *res, size_t lat_capacity)
+{
+	memset(res, 0, sizeof(*res));
+	if (lat_capacity > 0) {
+		res->lat = malloc(lat_capacity * sizeof(*res->lat));
+		if (res->lat == NULL)
+			abort();
+	}
+}
+
+static int
+bench_cmp_unsigned(const void *a, const void *b)
+{
+	unsigned x = *(const unsigned *)a;
+	unsigned y = *(const unsigned *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_report(const char *name, struct bench_result *res)
+{
+	double sec = (res->end - res->start) / 1e9;
+	printf("%-32s %12.0f msg/s", name, res->count / sec);
+	if (res->lat_count > 0) {
+		qsort(res->lat, res->lat_count, sizeof(*res->lat),
+		      bench_cmp_unsigned);
+		printf("   p50 %8u ns   p99 %8u ns",
+		       res->lat[res->lat_count / 2],
+		       res->lat[res->lat_count * 99 / 100]);
+	}
+	printf("\n");
+	fflush(stdout);
+	free(res->lat);
+}
+
+static void
+bench_check(int rc, const char *what)
+{
+	if (rc == 0)
+		return;
+	fprintf(stderr, "%s failed: error %d\n", what, (int)coro_bus_errno());
+	abort();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_bench {
+	struct coro_bus *bus;
+	int channel;
+	int reply_channel;
+	unsigned count;
+	struct bench_result *res;
+};
+
+static void *
+echo_f(void *arg)
+{
+	struct ctx_bench *ctx = arg;
+	unsigned data;
+	while (coro_bus_recv(ctx->bus, ctx->channel, &data) == 0)
+		bench_check(coro_bus_send(ctx->bus, ctx->reply_channel, data), "send");
+	return NULL;
+}
+
+/** One message back and forth at a time. Latency is round trip. */
+static void
+bench_ping_pong(unsigned count)
+{
+	struct coro_bus *bus = coro_bus_new();
+	struct ctx_bench ctx;
+	ctx.bus = bus;
+	ctx.channel = coro_bus_channel_open(bus, 1);
+	ctx.reply_channel = coro_bus_channel_open(bus, 1);
+	struct coro *echo = coro_new(echo_f, &ctx);
+	struct bench_result res;
+	bench_result_create(&res, count);
+	res.start = bench_now();
+	for (unsigned i = 0; i < count; ++i) {
+		unsigned data;
+		bench_check(coro_bus_send(bus, ctx.channel, bench_stamp()), "send");
+		bench_check(coro_bus_recv(bus, ctx.reply_channel, &data), "recv");
+		res.lat[res.lat_count++] = bench_latency(data);
+	}
+	res.end = bench_now();
+	res.count = count;
+	coro_bus_channel_close(bus, ctx.channel);
+	coro_join(echo);
+	coro_bus_channel_close(bus, ctx.reply_channel);
+	coro_bus_delete(bus);
+	bench_report("ping-pong (round trips)", &res);
+}
+
+static void *
+stamp_send_f(void *arg)
+{
+	struct ctx_bench *ctx = arg;
+	for (unsigned i = 0; i < ctx->count; ++i)
+		bench_check(coro_bus_send(ctx->bus, ctx->channel, bench_stamp()), "send");
+	return NULL;
+}
+
+/** Many senders into one channel, one receiver. */
+static void
+bench_fan_in(unsigned count, unsigned sender_count)
+{
+	struct coro_bus *bus = coro_bus_new();
+	int channel = coro_bus_channel_open(bus, 128);
+	struct ctx_bench *ctxs = calloc(sender_count, sizeof(*ctxs));
+	struct coro **senders = calloc(sender_count, sizeof(*senders));
+	unsigned per_sender = count / sender_count;
+	count = per_sender * sender_count;
+	struct bench_result res;
+	bench_result_create(&res, count);
+	res.start = bench_now();
+	for (unsigned i = 0; i < sender_count; ++i) {
+		ctxs[i].bus = bus;
+		ctxs[i].channel = channel;
+		ctxs[i].count = per_sender;
+		senders[i] = coro_new(stamp_send_f, &ctxs[i]);
+	}
+	for (unsigned i = 0; i < count; ++i) {
+		unsigned data;
+		bench_check(coro_bus_recv(bus, channel, &data), "recv");
+		res.lat[res.lat_count++] = bench_latency(data);
+	}
+	res.end = bench_now();
+	res.count = count;
+	for (unsigned i = 0; i < sender_count; ++i)
+		coro_join(senders[i]);
+	coro_bus_channel_close(bus, channel);
+	coro_bus_delete(bus);
+	free(senders);
+	free(ctxs);
+	char name[64];
+	snprintf(name, sizeof(name), "fan-in %u:1", sender_count);
+	bench_report(name, &res);
+}
+
+static void *
+stamp_recv_f(void *arg)
+{
+	struct ctx_bench *ctx = arg;
+	struct bench_result *res = ctx->res;
+	unsigned data;
+	for (unsigned i = 0; i < ctx->count; ++i) {
+		bench_check(coro_bus_recv(ctx->bus, ctx->channel, &data), "recv");
+		res->lat[res->lat_count++] = bench_latency(data);
+	}
+	return NULL;
+}
+
+/** One sender into many channels, a receiver on each. */
+static void
+bench_fan_out(unsigned count, unsigned receiver_count)
+{
+	struct coro_bus *bus = coro_bus_new();
+	struct ctx_bench *ctxs = calloc(receiver_count, sizeof(*ctxs));
+	struct coro **receivers = calloc(receiver_count, sizeof(*receivers));
+	unsigned per_receiver = count / receiver_count;
+	count = per_receiver * receiver_count;
+	struct bench_result res;
+	bench_result_create(&res, count);
+	for (unsigned i = 0; i < receiver_count; ++i) {
+		ctxs[i].bus = bus;
+		ctxs[i].channel = coro_bus_channel_open(bus, 128);
+		ctxs[i].count = per_receiver;
+		ctxs[i].res = &res;
+		receivers[i] = coro_new(stamp_recv_f, &ctxs[i]);
+	}
+	res.start = bench_now();
+	for (unsigned i = 0; i < count; ++i) {
+		int channel = ctxs[i % receiver_count].channel;
+		bench_check(coro_bus_send(bus, channel, bench_stamp()), "send");
+	}
+	for (unsigned i = 0; i < receiver_count; ++i)
+		coro_join(receivers[i]);
+	res.end = bench_now();
+	res.count = count;
+	for (unsigned i = 0; i < receiver_count; ++i)
+		coro_bus_channel_close(bus, ctxs[i].channel);
+	coro_bus_delete(bus);
+	free(receivers);
+	free(ctxs);
+	char name[64];
+	snprintf(name, sizeof(name), "fan-out 1:%u", receiver_count);
+	bench_report(name, &res);
+}
+
+/** Broadcast into many channels. The rate counts each delivery. */
+static void
+bench_broadcast(unsigned count, unsigned channel_count)
+{
+	struct coro_bus *bus = coro_bus_new();
+	struct ctx_bench *ctxs = calloc(channel_count, sizeof(*ctxs));
+	struct coro **receivers = calloc(channel_count, sizeof(*receivers));
+	count /= channel_count;
+	struct bench_result res;
+	bench_result_create(&res, (size_t)count * channel_count);
+	for (unsigned i = 0; i < channel_count; ++i) {
+		ctxs[i].bus = bus;
+		ctxs[i].channel = coro_bus_channel_open(bus, 128);
+		ctxs[i].count = count;
+		ctxs[i].res = &res;
+		receivers[i] = coro_new(stamp_recv_f, &ctxs[i]);
+	}
+	res.start = bench_now();
+	for (unsigned i = 0; i < count; ++i)
+		bench_check(coro_bus_broadcast(bus, bench_stamp()), "broadcast");
+	for (unsigned i = 0; i < channel_count; ++i)
+		coro_join(receivers[i]);
+	res.end = bench_now();
+	res.count = (uint64_t)count * channel_count;
+	for (unsigned i = 0; i < channel_count; ++i)
+		coro_bus_channel_close(bus, ctxs[i].channel);
+	coro_bus_delete(bus);
+	free(receivers);
+	free(ctxs);
+	char name[64];
+	snprintf(name, sizeof(name), "broadcast to %u", channel_count);
+	bench_report(name, &res);
+}
+
+/** Fill a channel big enough for all the messages, then drain it. */
+static void
+bench_deep_queue(unsigned count)
+{
+	struct coro_bus *bus = coro_bus_new();
+	int channel = coro_bus_channel_open(bus, count);
+	struct bench_result res;
+	bench_result_create(&res, 0);
+	res.start = bench_now();
+	for (unsigned i = 0; i < count; ++i)
+		bench_check(coro_bus_try_send(bus, channel, i), "send");
+	for (unsigned i = 0; i < count; ++i) {
+		unsigned data;
+		bench_check(coro_bus_try_recv(bus, channel, &data), "recv");
+	}
+	res.end = bench_now();
+	res.count = count;
+	coro_bus_channel_close(bus, channel);
+	coro_bus_delete(bus);
+	bench_report("deep queue", &res);
+}
+
+static void *
+drain_f(void *arg)
+{
+	struct ctx_bench *ctx = arg;
+	unsigned data;
+	for (unsigned i = 0; i < ctx->count; ++i)
+		bench_check(coro_bus_recv(ctx->bus, ctx->channel, &data), "recv");
+	return NULL;
+}
+
+/**
+ * Sender and receiver in coroutines, the channel limit is the
+ * batch: how many messages pass per switch between them.
+ */
+static void
+bench_batch(unsigned count, unsigned batch)
+{
+	struct coro_bus *bus = coro_bus_new();
+	struct ctx_bench ctx;
+	ctx.bus = bus;
+	ctx.channel = coro_bus_channel_open(bus, batch);
+	ctx.count = count;
+	struct bench_result res;
+	bench_result_create(&res, 0);
+	res.start = bench_now();
+	struct coro *receiver = coro_new(drain_f, &ctx);
+	for (unsigned i = 0; i < count; ++i)
+		bench_check(coro_bus_send(bus, ctx.channel, i), "send");
+	coro_join(receiver);
+	res.end = bench_now();
+	res.count = count;
+	coro_bus_channel_close(bus, ctx.channel);
+	coro_bus_delete(bus);
+	char name[64];
+	snprintf(name, sizeof(name), "%u per switch", batch);
+	bench_report(name, &res);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_bench_mt {
+	struct coro_bus_mt_channel *ch;
+	unsigned count;
+	struct bench_result *res;
+};
+
+static void *
+mt_send_f(void *arg)
+{
+	struct ctx_bench_mt *ctx = arg;
+	for (unsigned i = 0; i < ctx->count; ++i)
+		bench_check(coro_bus_mt_send(ctx->ch, bench_stamp()), "send");
+	return NULL;
+}
+
+static void *
+mt_recv_f(void *arg)
+{
+	struct ctx_bench_mt *ctx = arg;
+	struct bench_result *res = ctx->res;
+	unsigned data;
+	for (unsigned i = 0; i < ctx->count; ++i) {
+		bench_check(coro_bus_mt_recv(ctx->ch, &data), "recv");
+		res->lat[res->lat_count++] = bench_latency(data);
+	}
+	return NULL;
+}
+
+/** A thread-safe channel between two plain threads. */
+static void
+bench_mt(unsigned count, enum coro_bus_mt_type type, const char *name)
+{
+	struct ctx_bench_mt ctx;
+	struct bench_result res;
+	bench_result_create(&res, count);
+	ctx.ch = coro_bus_mt_channel_new(1024, type);
+	ctx.count = count;
+	ctx.res = &res;
+	pthread_t sender, receiver;
+	res.start = bench_now();
+	pthread_create(&receiver, NULL, mt_recv_f, &ctx);
+	pthread_create(&sender, NULL, mt_send_f, &ctx);
+	pthread_join(sender, NULL);
+	pthread_join(receiver, NULL);
+	res.end = bench_now();
+	res.count = count;
+	coro_bus_mt_channel_close(ctx.ch);
+	coro_bus_mt_channel_delete(ctx.ch);
+	bench_report(name, &res);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_main_f(void *arg)
+{
+	unsigned count = *(unsigned *)arg;
+	bench_ping_pong(count);
+	bench_fan_in(count, 8);
+	bench_fan_in(count, 128);
+	bench_fan_out(count, 8);
+	bench_fan_out(count, 128);
+	bench_broadcast(count, 1);
+	bench_broadcast(count, 16);
+	bench_broadcast(count, 256);
+	bench_deep_queue(count);
+	bench_batch(count, 1);
+	bench_batch(count, 16);
+	bench_batch(count, 256);
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned count = 1000000;
+	if (argc > 1)
+		count = (unsigned)strtoul(argv[1], NULL, 10);
+	if (count < 256) {
+		fprintf(stderr, "message count must be at least 256\n");
+		return 1;
+	}
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, &count);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+
+	bench_mt(count, CORO_BUS_MT_SPSC, "threads, spsc");
+	bench_mt(count, CORO_BUS_MT_MPMC, "threads, mpmc");
+	return 0;
+}
@@ -4,26 +4,70 @@
 #include "rlist.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
+static uint64_t clock_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Deadline in @a timeout_ns from now. Too far ones are clamped. */
+static uint64_t clock_deadline(uint64_t timeout_ns)
+{
+	uint64_t now = clock_now();
+	return timeout_ns > UINT64_MAX - now ? UINT64_MAX : now + timeout_ns;
+}
+
+/** A message in a channel queue. */
+struct data_msg
+{
+	unsigned data;
+#if CORO_BUS_STATS
+	/** When the message was enqueued, for the latency stats. */
+	uint64_t stamp;
+#endif
+};
+
+/**
+ * Message queue of a channel. It is a ring, which storage grows on
+ * demand in chunks up to the limit, and shrinks back after a burst
+ * is consumed. So the limit is only a bound, not a preallocation.
+ */
 struct data_vector 
 {
-	unsigned* data;
+	struct data_msg* data;
+	/** Index of the first message in the ring. */
+	size_t begin;
 	size_t size;
+	/** How many messages the storage fits now. */
 	size_t capacity;
+	/** How many messages the vector can hold at most. */
+	size_t limit;
 };
 
-/**
- * simple function for vector (there's non-like stl content)
- */
+enum
+{
+	/** The smallest storage allocated for a non-empty vector. */
+	DATA_VECTOR_MIN_CAPACITY = 16,
+};
 
-static void data_vector_init(struct data_vector* vector, size_t capacity)
+static void data_vector_init(struct data_vector* vector, size_t limit)
 {
 	assert(vector);
-    vector->capacity = capacity;
+	vector->data = NULL;
+	vector->begin = 0;
     vector->size = 0;
-    vector->data = (unsigned*) malloc(capacity * sizeof(unsigned));
+    vector->capacity = 0;
+	vector->limit = limit;
 }
 
 static void data_vector_destroy(struct data_vector* vector)
@@ -32,19 +76,247 @@ static void data_vector_destroy(struct data_vector* vector)
     free(vector->data);
 }
 
-static void data_vector_push_back(struct data_vector* vector, unsigned data)
+static bool data_vector_is_full(const struct data_vector* vector)
+{
+	return vector->size >= vector->limit;
+}
+
+/** Move the messages into a storage of the given capacity. */
+static void data_vector_resize(struct data_vector* vector, size_t capacity)
+{
+	assert(capacity >= vector->size);
+	struct data_msg* data = NULL;
+	if (capacity > 0)
+	{
+		data = (struct data_msg*) malloc(capacity * sizeof(*data));
+		size_t tail = vector->capacity - vector->begin;
+		if (tail >= vector->size)
+		{
+			memcpy(data, vector->data + vector->begin, vector->size * sizeof(*data));
+		}
+		else
+		{
+			memcpy(data, vector->data + vector->begin, tail * sizeof(*data));
+			memcpy(data + tail, vector->data, (vector->size - tail) * sizeof(*data));
+		}
+	}
+	free(vector->data);
+	vector->data = data;
+	vector->begin = 0;
+	vector->capacity = capacity;
+}
+
+/** Make room for one more message at the end. */
+static struct data_msg* data_vector_push_slot(struct data_vector* vector)
 {
 	assert(vector);
-    assert(vector->size < vector->capacity);
-    vector->data[vector->size++] = data;
+    assert(vector->size < vector->limit);
+	if (vector->size == vector->capacity)
+	{
+		size_t capacity = vector->capacity * 2;
+		if (capacity < DATA_VECTOR_MIN_CAPACITY)
+			capacity = DATA_VECTOR_MIN_CAPACITY;
+		if (capacity > vector->limit)
+			capacity = vector->limit;
+		data_vector_resize(vector, capacity);
+	}
+	size_t pos = vector->begin + vector->size++;
+	if (pos >= vector->capacity)
+		pos -= vector->capacity;
+	return &vector->data[pos];
+}
+
+static struct data_msg data_msg_new(unsigned data)
+{
+	struct data_msg msg;
+	msg.data = data;
+#if CORO_BUS_STATS
+	msg.stamp = clock_now();
+#endif
+	return msg;
+}
+
+/**
+ * Overflow of a lane in a file. Messages go here while the ring is
+ * full, and move back into the ring as it drains, so the order is
+ * kept. The file is mapped, the page cache decides how much of it
+ * stays in memory.
+ */
+struct data_spill
+{
+	int fd;
+	struct data_msg* data;
+	/** How many messages the file fits. */
+	size_t capacity;
+	/** The messages are in [begin, end). */
+	size_t begin;
+	size_t end;
+	/**
+	 * The file is full and can't grow, the disk or the limits are
+	 * out. The lane counts as full until the receivers free some.
+	 */
+	bool is_full;
+};
+
+enum
+{
+	DATA_SPILL_MIN_CAPACITY = 4096,
+};
+
+/**
+ * Resize the file and map it again. On failure the old mapping is
+ * kept as is. The blocks are allocated up front, so a full disk is
+ * an error here and not a SIGBUS on a write into the mapping.
+ */
+static int data_spill_map(struct data_spill* spill, size_t capacity)
+{
+	size_t size = capacity * sizeof(struct data_msg);
+	if (capacity > spill->capacity)
+	{
+		int rc = posix_fallocate(spill->fd, 0, size);
+		if (rc != 0)
+		{
+			errno = rc;
+			return -1;
+		}
+	}
+	void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spill->fd, 0);
+	if (addr == MAP_FAILED)
+		return -1;
+	if (spill->data)
+		munmap(spill->data, spill->capacity * sizeof(struct data_msg));
+	if (capacity < spill->capacity && ftruncate(spill->fd, size) != 0)
+	{
+		/* Harmless, the disk stays taken until the next try. */
+	}
+	spill->data = (struct data_msg*) addr;
+	spill->capacity = capacity;
+	return 0;
+}
+
+static struct data_spill* data_spill_new(const char* dir)
+{
+	const char name[] = "/corobus-spill-XXXXXX";
+	char* path = (char*) malloc(strlen(dir) + sizeof(name));
+	assert(path);
+	strcpy(path, dir);
+	strcat(path, name);
+	int fd = mkstemp(path);
+	if (fd < 0)
+	{
+		free(path);
+		return NULL;
+	}
+	/* Nobody else needs the name, and the disk is freed on close. */
+	unlink(path);
+	free(path);
+	struct data_spill* spill = (struct data_spill*) malloc(sizeof(*spill));
+	assert(spill);
+	spill->fd = fd;
+	spill->data = NULL;
+	spill->capacity = 0;
+	spill->begin = 0;
+	spill->end = 0;
+	spill->is_full = false;
+	if (data_spill_map(spill, DATA_SPILL_MIN_CAPACITY) != 0)
+	{
+		close(fd);
+		free(spill);
+		return NULL;
+	}
+	return spill;
+}
+
+static void data_spill_delete(struct data_spill* spill)
+{
+	if (spill->data)
+		munmap(spill->data, spill->capacity * sizeof(struct data_msg));
+	close(spill->fd);
+	free(spill);
+}
+
+static bool data_spill_is_empty(const struct data_spill* spill)
+{
+	return spill->begin == spill->end;
+}
+
+/**
+ * Make room for one more message at the end. The file grows, unless
+ * the front half is free already and compacting is enough. When it
+ * can't grow, whatever is free at the front is used.
+ * @retval false No room, the file is full and can't grow.
+ */
+static bool data_spill_reserve(struct data_spill* spill)
+{
+	if (spill->end < spill->capacity)
+		return true;
+	if (spill->begin < spill->capacity / 2 &&
+		data_spill_map(spill, spill->capacity * 2) == 0)
+		return true;
+	if (spill->begin == 0)
+		return false;
+	size_t size = spill->end - spill->begin;
+	memmove(spill->data, spill->data + spill->begin, size * sizeof(struct data_msg));
+	spill->begin = 0;
+	spill->end = size;
+	return true;
+}
+
+static void data_spill_push_back(struct data_spill* spill, struct data_msg msg)
+{
+	assert(!spill->is_full && spill->end < spill->capacity);
+	spill->data[spill->end++] = msg;
+	/* Find room for the next one now, the lane becomes full if none. */
+	spill->is_full = !data_spill_reserve(spill);
+}
+
+static struct data_msg data_spill_pop_front(struct data_spill* spill)
+{
+	assert(!data_spill_is_empty(spill));
+	struct data_msg msg = spill->data[spill->begin++];
+	if (data_spill_is_empty(spill))
+	{
+		spill->begin = spill->end = 0;
+		spill->is_full = false;
+		/* Give the disk back after a long stall. */
+		if (spill->capacity > DATA_SPILL_MIN_CAPACITY)
+			data_spill_map(spill, DATA_SPILL_MIN_CAPACITY);
+	}
+	else if (spill->is_full)
+	{
+		spill->is_full = !data_spill_reserve(spill);
+	}
+	return msg;
 }
 
-static unsigned data_vector_pop_front(struct data_vector* vector)
+static struct data_msg data_vector_pop_front(struct data_vector* vector)
 {
 	assert(vector);
     assert(vector->size > 0);
-    unsigned data = vector->data[0];
-    memmove(vector->data, vector->data + 1, --vector->size * sizeof(unsigned));
+    struct data_msg data = vector->data[vector->begin];
+	if (++vector->begin == vector->capacity)
+		vector->begin = 0;
+	--vector->size;
+	/*
+	 * Give the memory back after a burst. Shrink only when the
+	 * queue is well below the half, so as not to bounce between
+	 * the sizes on every message.
+	 */
+	if (vector->size == 0)
+	{
+		vector->begin = 0;
+		if (vector->capacity > DATA_VECTOR_MIN_CAPACITY)
+			data_vector_resize(vector, 0);
+	}
+	else if (vector->capacity > vector->limit && vector->size <= vector->limit)
+	{
+		/* The limit was lowered, and the queue is under it now. */
+		data_vector_resize(vector, vector->limit);
+	}
+	else if (vector->capacity > DATA_VECTOR_MIN_CAPACITY && vector->size <= vector->capacity / 4)
+	{
+		data_vector_resize(vector, vector->capacity / 2);
+	}
     return data;
 }
 
@@ -64,11 +336,41 @@ struct wakeup_queue
 	struct rlist coros;
 };
 
-#if 0 /* Uncomment this if want to use */
+static void wakeup_queue_wakeup_first(struct wakeup_queue* queue)
+{
+	assert(queue);
+    if (!rlist_empty(&queue->coros)) 
+	{
+        struct wakeup_entry* entry = rlist_first_entry(&queue->coros, struct wakeup_entry, base);
+        coro_wakeup(entry->coro);
+    }
+}
+
+static void wakeup_queue_wakeup_all(struct wakeup_queue* queue)
+{
+	assert(queue);
+	struct wakeup_entry* entry;
+	rlist_foreach_entry(entry, &queue->coros, base)
+		coro_wakeup(entry->coro);
+}
+
+/**
+ * Take all the coros out of the queue and wake them up. Used when
+ * the object they wait on is destroyed.
+ */
+static void wakeup_queue_drain(struct wakeup_queue* queue)
+{
+	assert(queue);
+	while (!rlist_empty(&queue->coros))
+	{
+		struct wakeup_entry* entry = rlist_first_entry(&queue->coros, struct wakeup_entry, base);
+		rlist_del_entry(entry, base);
+		coro_wakeup(entry->coro);
+	}
+}
 
 /** Suspend the current coroutine until it is woken up. */
-static void
-wakeup_queue_suspend_this(struct wakeup_queue *queue)
+static void wakeup_queue_suspend_this(struct wakeup_queue* queue)
 {
 	struct wakeup_entry entry;
 	entry.coro = coro_this();
@@ -77,40 +379,285 @@ wakeup_queue_suspend_this(struct wakeup_queue *queue)
 	rlist_del_entry(&entry, base);
 }
 
-#endif
+/**
+ * Same as wakeup_queue_suspend_this(), but gives up at the
+ * deadline. 0 deadline means no deadline.
+ * @retval true The deadline has come.
+ */
+static bool wakeup_queue_suspend_this_until(struct wakeup_queue* queue, uint64_t deadline)
+{
+	if (deadline == 0)
+	{
+		wakeup_queue_suspend_this(queue);
+		return false;
+	}
+	uint64_t now = clock_now();
+	if (now >= deadline)
+		return true;
+	struct wakeup_entry entry;
+	entry.coro = coro_this();
+	rlist_add_tail_entry(&queue->coros, &entry, base);
+	bool is_timed_out = coro_suspend_timeout(deadline - now);
+	rlist_del_entry(&entry, base);
+	return is_timed_out;
+}
 
-static void wakeup_queue_wakeup_first(struct wakeup_queue* queue)
+/**
+ * Descriptor table. Closed descriptors are kept in a free-list and
+ * are reused first, so taking and releasing one is O(1). The slot
+ * array grows geometrically. Each slot has a generation bumped on
+ * each reuse, to tell a stale descriptor from a fresh one.
+ */
+struct desc_slot
 {
-	assert(queue);
-    if (!rlist_empty(&queue->coros)) 
+	void* obj;
+	/** Next free slot while this one is free. */
+	int next_free;
+	unsigned gen;
+};
+
+struct desc_table
+{
+	struct desc_slot* slots;
+	/** Number of slots ever used. All descriptors are below it. */
+	int count;
+	int capacity;
+	/** Head of the free-list, -1 when empty. */
+	int free_head;
+};
+
+static void desc_table_create(struct desc_table* table)
+{
+	assert(table);
+	table->slots = NULL;
+	table->count = 0;
+	table->capacity = 0;
+	table->free_head = -1;
+}
+
+static void desc_table_destroy(struct desc_table* table)
+{
+	assert(table);
+	free(table->slots);
+}
+
+static int desc_table_alloc(struct desc_table* table, void* obj)
+{
+	assert(table && obj);
+	int id = table->free_head;
+	if (id >= 0)
 	{
-        struct wakeup_entry* entry = rlist_first_entry(&queue->coros, struct wakeup_entry, base);
-        coro_wakeup(entry->coro);
-    }
+		table->free_head = table->slots[id].next_free;
+	}
+	else
+	{
+		if (table->count == table->capacity)
+		{
+			table->capacity = (table->capacity + 1) * 2;
+			table->slots = realloc(table->slots, table->capacity * sizeof(*table->slots));
+		}
+		id = table->count++;
+		table->slots[id].gen = 0;
+	}
+	struct desc_slot* slot = &table->slots[id];
+	slot->obj = obj;
+	slot->next_free = -1;
+	++slot->gen;
+	return id;
 }
 
-struct coro_bus_channel 
+static void desc_table_free(struct desc_table* table, int id)
 {
-	/** Channel max capacity.*/
-	size_t size_limit;
+	assert(table && id >= 0 && id < table->count);
+	struct desc_slot* slot = &table->slots[id];
+	assert(slot->obj);
+	slot->obj = NULL;
+	slot->next_free = table->free_head;
+	table->free_head = id;
+}
+
+static void* desc_table_get(const struct desc_table* table, int id)
+{
+	assert(table);
+	if (id < 0 || id >= table->count)
+		return NULL;
+	return table->slots[id].obj;
+}
+
+/** A priority lane of a channel, with its own capacity. */
+struct channel_lane
+{
+	/** Message queue. */
+	struct data_vector data;
 
-	/** Coroutines waiting until the channel is not full. */
+	/** Coroutines waiting until the lane is not full. */
 	struct wakeup_queue send_queue;
 
+	/** Where the messages go when the ring is full, or NULL. */
+	struct data_spill* spill;
+};
+
+static void channel_lane_destroy(struct channel_lane* lane)
+{
+	data_vector_destroy(&lane->data);
+	if (lane->spill)
+		data_spill_delete(lane->spill);
+}
+
+struct coro_bus_channel 
+{
+	/** Max capacity of each lane.*/
+	size_t size_limit;
+
 	/** Coroutines waiting until the channel is not empty. */
 	struct wakeup_queue recv_queue;
 
-	/** Message queue. */
-	struct data_vector data;
+	/**
+	 * Lanes, the higher index the higher priority. Lane 0 is the
+	 * default one, used by plain send and by broadcast. The channel
+	 * counts as full when lane 0 is full.
+	 */
+	struct channel_lane* lanes;
+	unsigned lane_count;
+
+	/** Messages in all the lanes. */
+	size_t size;
+
+	/** Descriptors of the groups the channel is a member of. */
+	int* groups;
+	int group_count;
+	int group_capacity;
+
+	/** Calls sent here and not taken by a server yet. */
+	struct rlist calls;
+
+#if CORO_BUS_STATS
+	struct coro_bus_channel_stats stats;
+#endif
+};
+
+/**
+ * A multicast group. Members are kept as a bitset over channel
+ * descriptors, so the fan-out visits only the set bits. Like the
+ * bus, the group counts its full members to check readiness in
+ * O(1).
+ */
+struct coro_bus_group
+{
+	uint64_t* members;
+	size_t word_count;
+	int member_count;
+	int full_count;
+	/** Multicasters waiting for all the members to get space. */
+	struct wakeup_queue send_queue;
+};
+
+/**
+ * A call in flight. The request message in the channel is the
+ * descriptor of the call, the payload and the reply are here.
+ * Finished calls are pooled, so a call allocates nothing in the
+ * steady state.
+ */
+struct coro_bus_call
+{
+	/** Link in the channel's list while nobody took the request. */
+	struct rlist in_channel;
+	/** Slot of the call in the descriptor table. */
+	int index;
+	unsigned req;
+	unsigned resp;
+	/** A server has received the request. */
+	bool is_taken;
+	bool is_done;
+	/** Result for the caller, set with is_done. */
+	enum coro_bus_error_code err;
+	/** The coroutine waiting for the reply. */
+	struct coro* waiter;
+	/** Next call in the pool. */
+	struct coro_bus_call* next_free;
+};
+
+struct coro_bus_topic;
+
+struct coro_bus_subscriber
+{
+	/** Topic the subscriber reads. */
+	struct coro_bus_topic* topic;
+	/** Sequence number of the next message to read. */
+	uint64_t cursor;
+	/** Descriptor of the subscriber in the bus. */
+	int id;
+	/** Position in the topic's subscriber array. */
+	size_t index;
+};
+
+struct coro_bus_topic
+{
+	/** Topic max capacity. */
+	size_t size_limit;
+
+	/** Shared ring of messages, size_limit of them. */
+	unsigned* ring;
+
+	/** Sequence number of the next published message. */
+	uint64_t head;
+
+	/**
+	 * The smallest cursor among the subscribers. The ring slots
+	 * before it are free.
+	 */
+	uint64_t min_cursor;
+
+	/**
+	 * How many subscribers stand at min_cursor. When it drops to
+	 * zero, the min cursor is searched again. It happens once
+	 * per message at most, so consume is O(1) amortized.
+	 */
+	size_t min_count;
+
+	struct coro_bus_subscriber** subs;
+	size_t sub_count;
+	size_t sub_capacity;
+
+	/** Coroutines waiting until the slowest subscriber reads. */
+	struct wakeup_queue send_queue;
+
+	/** Coroutines waiting until something is published. */
+	struct wakeup_queue recv_queue;
 };
 
 struct coro_bus 
 {
-	struct coro_bus_channel **channels;
+	/** Channel descriptors, struct coro_bus_channel. */
+	struct desc_table channels;
+
+	/** Topic descriptors, struct coro_bus_topic. */
+	struct desc_table topics;
+
+	/** Subscriber descriptors, struct coro_bus_subscriber. */
+	struct desc_table subscribers;
+
+	/** Multicast group descriptors, struct coro_bus_group. */
+	struct desc_table groups;
+
+	/** Call descriptors, struct coro_bus_call. */
+	struct desc_table calls;
+	/** Finished calls to reuse. */
+	struct coro_bus_call* call_pool;
+
+	/** Number of open channels. */
 	int channel_count;
+	/**
+	 * Number of full channels. A broadcast can go only when there
+	 * are none, so it is checked without visiting the channels.
+	 */
+	int full_count;
+	/** Broadcasters waiting for all the channels to get space. */
+	struct wakeup_queue broadcast_queue;
 };
 
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+/** Each thread has its own error, like errno. */
+static __thread enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
 
 enum coro_bus_error_code coro_bus_errno(void)
 {
@@ -125,8 +672,15 @@ void coro_bus_errno_set(enum coro_bus_error_code err)
 struct coro_bus* coro_bus_new(void)
 {
 	struct coro_bus* bus = (struct coro_bus*) malloc(sizeof(struct coro_bus));
-    bus->channel_count = 0;
-    bus->channels = NULL;
+	desc_table_create(&bus->channels);
+	desc_table_create(&bus->topics);
+	desc_table_create(&bus->subscribers);
+	desc_table_create(&bus->groups);
+	desc_table_create(&bus->calls);
+	bus->call_pool = NULL;
+	bus->channel_count = 0;
+	bus->full_count = 0;
+	rlist_create(&bus->broadcast_queue.coros);
 	coro_bus_errno_set(CORO_BUS_ERR_NONE); 
 	return bus;
 }
@@ -134,186 +688,696 @@ struct coro_bus* coro_bus_new(void)
 void coro_bus_delete(struct coro_bus* bus)
 {
 	assert(bus);
-	for (int i = 0; i < bus->channel_count; ++i) 
+	for (int i = 0; i < bus->channels.count; ++i) 
 	{
-        if (bus->channels[i]) 
+		struct coro_bus_channel* ch = desc_table_get(&bus->channels, i);
+        if (ch) 
 		{
-            data_vector_destroy(&bus->channels[i]->data);
-            free(bus->channels[i]);
+			for (unsigned l = 0; l < ch->lane_count; ++l)
+				channel_lane_destroy(&ch->lanes[l]);
+			free(ch->lanes);
+			free(ch->groups);
+            free(ch);
         }
     }
-    free(bus->channels);
+	desc_table_destroy(&bus->channels);
+	for (int i = 0; i < bus->groups.count; ++i)
+	{
+		struct coro_bus_group* group = desc_table_get(&bus->groups, i);
+		if (group)
+		{
+			assert(rlist_empty(&group->send_queue.coros));
+			free(group->members);
+			free(group);
+		}
+	}
+	desc_table_destroy(&bus->groups);
+	for (int i = 0; i < bus->calls.count; ++i)
+	{
+		struct coro_bus_call* call = desc_table_get(&bus->calls, i);
+		if (call)
+		{
+			assert(call->waiter == NULL);
+			free(call);
+		}
+	}
+	desc_table_destroy(&bus->calls);
+	while (bus->call_pool)
+	{
+		struct coro_bus_call* call = bus->call_pool;
+		bus->call_pool = call->next_free;
+		free(call);
+	}
+	for (int i = 0; i < bus->topics.count; ++i)
+	{
+		if (desc_table_get(&bus->topics, i))
+			coro_bus_topic_close(bus, i);
+	}
+	desc_table_destroy(&bus->topics);
+	desc_table_destroy(&bus->subscribers);
+	assert(rlist_empty(&bus->broadcast_queue.coros));
     free(bus);
     coro_bus_errno_set(CORO_BUS_ERR_NONE);
 }
 
-static void init(struct coro_bus* bus, size_t size_limit, int i) 
+static struct coro_bus_channel* channel_get(struct coro_bus* bus, int channel)
 {
 	assert(bus);
-	struct coro_bus_channel* ch = (struct coro_bus_channel*)malloc(sizeof(*ch));
-	assert(ch);
-	data_vector_init(&ch->data, size_limit);
-	ch->size_limit = size_limit;
-	rlist_create(&ch->send_queue.coros);
-	rlist_create(&ch->recv_queue.coros);
-	bus->channels[i] = ch;
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	struct coro_bus_channel* ch = desc_table_get(&bus->channels, channel);
+	if (!ch)
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return ch;
 }
 
-int coro_bus_channel_open(struct coro_bus* bus, size_t size_limit)
+/** A member got space. Multicasters care only when all have it. */
+static void group_on_member_not_full(struct coro_bus_group* group)
 {
-    assert(bus);
-    for (int i = 0; i < bus->channel_count; ++i) 
-    {
-        if (!bus->channels[i]) 
-        {
-            init(bus, size_limit, i);
-            return i;
-        }
-    }
-    int new_index = bus->channel_count;
-    bus->channel_count++;
-    bus->channels = realloc(bus->channels, bus->channel_count * sizeof(void*));
-    bus->channels[new_index] = NULL;
-    init(bus, size_limit, new_index);
-    return new_index;
+	assert(group->full_count > 0);
+	if (--group->full_count == 0)
+		wakeup_queue_wakeup_first(&group->send_queue);
 }
 
-void coro_bus_channel_close(struct coro_bus* bus, int channel)
+static void channel_on_full(struct coro_bus* bus, struct coro_bus_channel* ch)
 {
-	assert(bus);
-	if(channel < 0 || channel >= bus->channel_count || !bus->channels[channel])
-	{
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return;
-	}
-	struct coro_bus_channel* ch = bus->channels[channel];
-	while (!rlist_empty(&ch->send_queue.coros)) 
-	{
-        struct wakeup_entry* entry = rlist_first_entry(&ch->send_queue.coros, struct wakeup_entry, base);
-		rlist_del_entry(entry, base);
-        coro_wakeup(entry->coro);
-    }
+	++bus->full_count;
+	for (int i = 0; i < ch->group_count; ++i)
+		++((struct coro_bus_group*) desc_table_get(&bus->groups, ch->groups[i]))->full_count;
+}
 
-    while (!rlist_empty(&ch->recv_queue.coros)) 
-	{
-        struct wakeup_entry* entry = rlist_first_entry(&ch->recv_queue.coros, struct wakeup_entry, base);
-		rlist_del_entry(entry, base);
-        coro_wakeup(entry->coro);
-    }
-	data_vector_destroy(&ch->data);
-    free(ch);
-    bus->channels[channel] = NULL;
-    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+/** A channel got space. Broadcasters care only when all have it. */
+static void channel_on_not_full(struct coro_bus* bus, struct coro_bus_channel* ch)
+{
+	assert(bus->full_count > 0);
+	if (--bus->full_count == 0)
+		wakeup_queue_wakeup_first(&bus->broadcast_queue);
+	for (int i = 0; i < ch->group_count; ++i)
+		group_on_member_not_full(desc_table_get(&bus->groups, ch->groups[i]));
 }
 
-int coro_bus_send(struct coro_bus* bus, int channel, unsigned data)
+static bool channel_lane_is_full(const struct coro_bus_channel* ch, unsigned lane)
 {
-	while(true) 
-	{
-		int response = coro_bus_try_send(bus, channel, data);
-		if(response == 0) 
-			return 0;
-		if(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
-			return -1;
-		struct coro_bus_channel* ch = bus->channels[channel];
-		struct wakeup_entry entry;
-		entry.coro = coro_this();
-		rlist_add_tail_entry(&ch->send_queue.coros, &entry, base);
-        coro_suspend();
-        rlist_del_entry(&entry, base);
-	}
-	return 0;
+	const struct channel_lane* l = &ch->lanes[lane];
+	if (l->spill)
+		return l->spill->is_full;
+	return data_vector_is_full(&l->data);
 }
 
-int coro_bus_try_send(struct coro_bus* bus, int channel, unsigned data)
+static bool channel_is_full(const struct coro_bus_channel* ch)
 {
-	assert(bus);
-	if (channel < 0 || channel >= bus->channel_count || !bus->channels[channel]) 
-	{
-        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-        return -1;
-    }
-	struct coro_bus_channel* ch = bus->channels[channel];
-	if (ch->data.size >= ch->data.capacity) 
+	return channel_lane_is_full(ch, 0);
+}
+
+/** Move the spilled messages into the ring while it has space. */
+static void channel_lane_refill(struct channel_lane* lane)
+{
+	if (lane->spill == NULL)
+		return;
+	while (!data_spill_is_empty(lane->spill) && !data_vector_is_full(&lane->data))
+		*data_vector_push_slot(&lane->data) = data_spill_pop_front(lane->spill);
+}
+
+/** Put the message into the lane and wake up a receiver. */
+static void channel_push(struct coro_bus* bus, struct coro_bus_channel* ch, unsigned lane, unsigned data)
+{
+	struct channel_lane* l = &ch->lanes[lane];
+	if (l->spill && (!data_spill_is_empty(l->spill) || data_vector_is_full(&l->data)))
+		data_spill_push_back(l->spill, data_msg_new(data));
+	else
+		*data_vector_push_slot(&l->data) = data_msg_new(data);
+	++ch->size;
+	if (lane == 0 && channel_is_full(ch))
+		channel_on_full(bus, ch);
+#if CORO_BUS_STATS
+	++ch->stats.msg_in;
+	if (ch->size > ch->stats.depth_max)
+		ch->stats.depth_max = ch->size;
+#endif
+	wakeup_queue_wakeup_first(&ch->recv_queue);
+}
+
+/**
+ * Take a message from the highest non-empty lane and wake up a
+ * sender of that lane.
+ */
+static unsigned channel_pop(struct coro_bus* bus, struct coro_bus_channel* ch)
+{
+	assert(ch->size > 0);
+	unsigned lane = ch->lane_count - 1;
+	while (lane > 0 && ch->lanes[lane].data.size == 0)
+		--lane;
+	struct data_vector* vector = &ch->lanes[lane].data;
+	bool was_full = lane == 0 && channel_is_full(ch);
+	struct data_msg msg;
+	if (vector->size > 0)
+	{
+		msg = data_vector_pop_front(vector);
+		channel_lane_refill(&ch->lanes[lane]);
+	}
+	else
+	{
+		/* A zero limit, everything is in the spill. */
+		msg = data_spill_pop_front(ch->lanes[lane].spill);
+	}
+	--ch->size;
+#if CORO_BUS_STATS
+	++ch->stats.msg_out;
+	uint64_t latency = clock_now() - msg.stamp;
+	int bucket = latency < 2 ? 0 : 63 - __builtin_clzll(latency);
+	if (bucket >= CORO_BUS_LATENCY_BUCKETS)
+		bucket = CORO_BUS_LATENCY_BUCKETS - 1;
+	++ch->stats.latency_hist[bucket];
+#endif
+	/* After the limit was lowered the lane can stay full. */
+	if (!channel_lane_is_full(ch, lane))
+		wakeup_queue_wakeup_first(&ch->lanes[lane].send_queue);
+	if (was_full && !channel_is_full(ch))
+		channel_on_not_full(bus, ch);
+	return msg.data;
+}
+
+int coro_bus_channel_open(struct coro_bus* bus, size_t size_limit)
+{
+	return coro_bus_channel_open_lanes(bus, size_limit, 1);
+}
+
+int coro_bus_channel_open_lanes(struct coro_bus* bus, size_t size_limit, unsigned lane_count)
+{
+	assert(bus);
+	assert(lane_count > 0);
+	struct coro_bus_channel* ch = (struct coro_bus_channel*)malloc(sizeof(*ch));
+	assert(ch);
+	ch->size_limit = size_limit;
+	ch->lanes = (struct channel_lane*) malloc(lane_count * sizeof(struct channel_lane));
+	ch->lane_count = lane_count;
+	for (unsigned l = 0; l < lane_count; ++l)
+	{
+		data_vector_init(&ch->lanes[l].data, size_limit);
+		rlist_create(&ch->lanes[l].send_queue.coros);
+		ch->lanes[l].spill = NULL;
+	}
+	ch->size = 0;
+	rlist_create(&ch->recv_queue.coros);
+	ch->groups = NULL;
+	ch->group_count = 0;
+	ch->group_capacity = 0;
+	rlist_create(&ch->calls);
+#if CORO_BUS_STATS
+	memset(&ch->stats, 0, sizeof(ch->stats));
+#endif
+	++bus->channel_count;
+	if (channel_is_full(ch))
+		++bus->full_count;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return desc_table_alloc(&bus->channels, ch);
+}
+
+int coro_bus_channel_set_limit(struct coro_bus* bus, int channel, size_t size_limit)
+{
+	struct coro_bus_channel* ch = channel_get(bus, channel);
+	if (!ch)
+		return -1;
+	bool was_full = channel_is_full(ch);
+	bool is_grown = size_limit > ch->size_limit;
+	ch->size_limit = size_limit;
+	for (unsigned l = 0; l < ch->lane_count; ++l)
+	{
+		struct data_vector* vector = &ch->lanes[l].data;
+		vector->limit = size_limit;
+		/* Not below the queue, the rest is cut by the pops. */
+		if (vector->capacity > size_limit && vector->size <= size_limit)
+			data_vector_resize(vector, vector->size == 0 ? 0 : size_limit);
+		if (is_grown)
+		{
+			channel_lane_refill(&ch->lanes[l]);
+			wakeup_queue_wakeup_all(&ch->lanes[l].send_queue);
+		}
+	}
+	bool is_full = channel_is_full(ch);
+	if (was_full && !is_full)
+		channel_on_not_full(bus, ch);
+	else if (!was_full && is_full)
+		channel_on_full(bus, ch);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_channel_spill(struct coro_bus* bus, int channel, const char* dir)
+{
+	struct coro_bus_channel* ch = channel_get(bus, channel);
+	if (!ch)
+		return -1;
+	struct channel_lane* lane = &ch->lanes[0];
+	if (lane->spill == NULL)
+	{
+		bool was_full = channel_is_full(ch);
+		lane->spill = data_spill_new(dir);
+		if (lane->spill == NULL)
+		{
+			coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+			return -1;
+		}
+		if (was_full)
+		{
+			channel_on_not_full(bus, ch);
+			wakeup_queue_wakeup_all(&lane->send_queue);
+		}
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+static void group_remove_member(struct coro_bus_group* group, int channel, bool is_full);
+
+void coro_bus_channel_close(struct coro_bus* bus, int channel)
+{
+	struct coro_bus_channel* ch = channel_get(bus, channel);
+	if (!ch)
+		return;
+	for (unsigned l = 0; l < ch->lane_count; ++l)
+		wakeup_queue_drain(&ch->lanes[l].send_queue);
+	wakeup_queue_drain(&ch->recv_queue);
+	bool is_full = channel_is_full(ch);
+	for (int i = 0; i < ch->group_count; ++i)
+		group_remove_member(desc_table_get(&bus->groups, ch->groups[i]), channel, is_full);
+	/* The queued requests are lost, their callers would wait forever. */
+	while (!rlist_empty(&ch->calls))
+	{
+		struct coro_bus_call* call = rlist_shift_entry(&ch->calls, struct coro_bus_call, in_channel);
+		call->is_done = true;
+		call->err = CORO_BUS_ERR_NO_CHANNEL;
+		if (call->waiter)
+			coro_wakeup(call->waiter);
+	}
+	--bus->channel_count;
+	if (bus->channel_count == 0)
+	{
+		/* They all fail now. */
+		bus->full_count = 0;
+		wakeup_queue_wakeup_all(&bus->broadcast_queue);
+	}
+	else if (is_full)
+	{
+		assert(bus->full_count > 0);
+		if (--bus->full_count == 0)
+			wakeup_queue_wakeup_first(&bus->broadcast_queue);
+	}
+	for (unsigned l = 0; l < ch->lane_count; ++l)
+		channel_lane_destroy(&ch->lanes[l]);
+	free(ch->lanes);
+	free(ch->groups);
+    free(ch);
+	desc_table_free(&bus->channels, channel);
+    coro_bus_errno_set(CORO_BUS_ERR_NONE);
+}
+
+unsigned coro_bus_channel_gen(struct coro_bus* bus, int channel)
+{
+	if (!channel_get(bus, channel))
+		return 0;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return bus->channels.slots[channel].gen;
+}
+
+int coro_bus_channel_stats(struct coro_bus* bus, int channel, struct coro_bus_channel_stats* stats)
+{
+#if CORO_BUS_STATS
+	struct coro_bus_channel* ch = channel_get(bus, channel);
+	if (!ch)
+		return -1;
+	*stats = ch->stats;
+	stats->depth = ch->size;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+#else
+	(void)bus;
+	(void)channel;
+	(void)stats;
+	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+	return -1;
+#endif
+}
+
+#if CORO_BUS_STATS
+
+/**
+ * Upper bound of the latency below which the given share of the
+ * messages fits, in nanoseconds. The precision is the bucket.
+ */
+static uint64_t stats_percentile(const struct coro_bus_channel_stats* stats, unsigned percent)
+{
+	if (stats->msg_out == 0)
+		return 0;
+	uint64_t want = (stats->msg_out * percent + 99) / 100;
+	uint64_t seen = 0;
+	for (int i = 0; i < CORO_BUS_LATENCY_BUCKETS; ++i)
+	{
+		seen += stats->latency_hist[i];
+		if (seen >= want)
+			return (uint64_t)2 << i;
+	}
+	return (uint64_t)2 << (CORO_BUS_LATENCY_BUCKETS - 1);
+}
+
+#endif
+
+void coro_bus_stats_dump(struct coro_bus* bus, FILE* out)
+{
+#if CORO_BUS_STATS
+	for (int i = 0; i < bus->channels.count; ++i)
+	{
+		struct coro_bus_channel_stats stats;
+		if (coro_bus_channel_stats(bus, i, &stats) != 0)
+			continue;
+		fprintf(out, "channel %d: in %llu out %llu depth %zu max %zu "
+			"send_block %llu/%lluns recv_block %llu/%lluns "
+			"p50 <%lluns p99 <%lluns\n", i,
+			(unsigned long long)stats.msg_in,
+			(unsigned long long)stats.msg_out,
+			stats.depth, stats.depth_max,
+			(unsigned long long)stats.send_block_count,
+			(unsigned long long)stats.send_block_ns,
+			(unsigned long long)stats.recv_block_count,
+			(unsigned long long)stats.recv_block_ns,
+			(unsigned long long)stats_percentile(&stats, 50),
+			(unsigned long long)stats_percentile(&stats, 99));
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+#else
+	(void)bus;
+	(void)out;
+#endif
+}
+
+/**
+ * Send, waiting for space until the deadline. 0 deadline means
+ * waiting forever.
+ */
+static int channel_send(struct coro_bus* bus, int channel, unsigned lane, unsigned data, uint64_t deadline)
+{
+#if CORO_BUS_STATS
+	uint64_t block_start = 0;
+#endif
+	while(true) 
+	{
+		int response = coro_bus_try_send_lane(bus, channel, lane, data);
+		if(response == 0) 
+		{
+#if CORO_BUS_STATS
+			if (block_start != 0)
+			{
+				struct coro_bus_channel* ch = desc_table_get(&bus->channels, channel);
+				++ch->stats.send_block_count;
+				ch->stats.send_block_ns += clock_now() - block_start;
+			}
+#endif
+			return 0;
+		}
+		if(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return -1;
+		struct coro_bus_channel* ch = desc_table_get(&bus->channels, channel);
+#if CORO_BUS_STATS
+		if (block_start == 0)
+			block_start = clock_now();
+#endif
+		if (wakeup_queue_suspend_this_until(&ch->lanes[lane].send_queue, deadline))
+		{
+			/*
+			 * The wakeup could be given to this coroutine right
+			 * as the timer fired. Use the space, or it is taken
+			 * already and nobody else needs a wakeup.
+			 */
+			if (coro_bus_try_send_lane(bus, channel, lane, data) == 0)
+				return 0;
+			if (coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK)
+				coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int coro_bus_send(struct coro_bus* bus, int channel, unsigned data)
+{
+	return channel_send(bus, channel, 0, data, 0);
+}
+
+int coro_bus_send_timeout(struct coro_bus* bus, int channel, unsigned data, uint64_t timeout_ns)
+{
+	return channel_send(bus, channel, 0, data, clock_deadline(timeout_ns));
+}
+
+int coro_bus_try_send(struct coro_bus* bus, int channel, unsigned data)
+{
+	return coro_bus_try_send_lane(bus, channel, 0, data);
+}
+
+int coro_bus_send_lane(struct coro_bus* bus, int channel, unsigned lane, unsigned data)
+{
+	return channel_send(bus, channel, lane, data, 0);
+}
+
+int coro_bus_try_send_lane(struct coro_bus* bus, int channel, unsigned lane, unsigned data)
+{
+	struct coro_bus_channel* ch = channel_get(bus, channel);
+	if (!ch)
+		return -1;
+	if (lane >= ch->lane_count)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (channel_lane_is_full(ch, lane)) 
 	{
         coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
         return -1;
     }
-	data_vector_push_back(&ch->data, data);
-    wakeup_queue_wakeup_first(&ch->recv_queue);
+	channel_push(bus, ch, lane, data);
     coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	return 0;
 }
 
 int coro_bus_try_recv(struct coro_bus* bus, int channel, unsigned* data)
 {
-	assert(bus);
-    if (channel < 0 || channel >= bus->channel_count || !bus->channels[channel]) 
-	{
-        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-        return -1;
-    }
-    struct coro_bus_channel* ch = bus->channels[channel];
-    if (ch->data.size == 0) 
+	struct coro_bus_channel* ch = channel_get(bus, channel);
+	if (!ch)
+		return -1;
+    if (ch->size == 0) 
 	{
         coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
         return -1;
     }
-    *data = data_vector_pop_front(&ch->data);
-    wakeup_queue_wakeup_first(&ch->send_queue);
+    *data = channel_pop(bus, ch);
     coro_bus_errno_set(CORO_BUS_ERR_NONE);
     return 0;
 }
 
-int coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+/**
+ * Receive, waiting for data until the deadline. 0 deadline means
+ * waiting forever.
+ */
+static int channel_recv(struct coro_bus* bus, int channel, unsigned* data, uint64_t deadline)
 {
+#if CORO_BUS_STATS
+	uint64_t block_start = 0;
+#endif
     while (true) 
 	{
         int rc = coro_bus_try_recv(bus, channel, data);
         if (rc == 0)
+		{
+#if CORO_BUS_STATS
+			if (block_start != 0)
+			{
+				struct coro_bus_channel* ch = desc_table_get(&bus->channels, channel);
+				++ch->stats.recv_block_count;
+				ch->stats.recv_block_ns += clock_now() - block_start;
+			}
+#endif
             return 0;
+		}
 		if(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) 
 			return -1;
-        struct coro_bus_channel *ch = bus->channels[channel];
-        struct wakeup_entry entry;
-        entry.coro = coro_this();
-        rlist_add_tail_entry(&ch->recv_queue.coros, &entry, base);
-        coro_suspend();
-        rlist_del_entry(&entry, base);
+        struct coro_bus_channel *ch = desc_table_get(&bus->channels, channel);
+#if CORO_BUS_STATS
+		if (block_start == 0)
+			block_start = clock_now();
+#endif
+		if (wakeup_queue_suspend_this_until(&ch->recv_queue, deadline))
+		{
+			/* Same as for send - don't lose a wakeup racing with the timer. */
+			if (coro_bus_try_recv(bus, channel, data) == 0)
+				return 0;
+			if (coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK)
+				coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
     }
 	return 0;
 }
 
+int coro_bus_recv(struct coro_bus* bus, int channel, unsigned* data)
+{
+	return channel_recv(bus, channel, data, 0);
+}
+
+int coro_bus_recv_timeout(struct coro_bus* bus, int channel, unsigned* data, uint64_t timeout_ns)
+{
+	return channel_recv(bus, channel, data, clock_deadline(timeout_ns));
+}
+
+/**
+ * A call descriptor is the slot index with the low bits of the slot
+ * generation above it. So a stale descriptor of a finished call
+ * doesn't reach the next call in the same slot.
+ */
+enum
+{
+	CALL_INDEX_BITS = 20,
+	CALL_GEN_MASK = (1 << (31 - CALL_INDEX_BITS)) - 1,
+};
+
+static int call_id(const struct coro_bus* bus, int index)
+{
+	unsigned gen = bus->calls.slots[index].gen & CALL_GEN_MASK;
+	return (int)(gen << CALL_INDEX_BITS) | index;
+}
+
+static struct coro_bus_call* call_get(struct coro_bus* bus, int id)
+{
+	if (id < 0)
+		return NULL;
+	int index = id & ((1 << CALL_INDEX_BITS) - 1);
+	struct coro_bus_call* call = desc_table_get(&bus->calls, index);
+	if (!call || call_id(bus, index) != id)
+		return NULL;
+	return call;
+}
+
+static void call_free(struct coro_bus* bus, struct coro_bus_call* call)
+{
+	rlist_del_entry(call, in_channel);
+	desc_table_free(&bus->calls, call->index);
+	call->next_free = bus->call_pool;
+	bus->call_pool = call;
+}
+
+int coro_bus_call_start(struct coro_bus* bus, int channel, unsigned req)
+{
+	assert(bus);
+	struct coro_bus_channel* ch = channel_get(bus, channel);
+	if (!ch)
+		return -1;
+	struct coro_bus_call* call = bus->call_pool;
+	if (call)
+		bus->call_pool = call->next_free;
+	else
+		call = (struct coro_bus_call*) malloc(sizeof(*call));
+	assert(call);
+	call->req = req;
+	call->resp = 0;
+	call->is_taken = false;
+	call->is_done = false;
+	call->err = CORO_BUS_ERR_NONE;
+	call->waiter = NULL;
+	call->next_free = NULL;
+	call->index = desc_table_alloc(&bus->calls, call);
+	rlist_add_tail_entry(&ch->calls, call, in_channel);
+	if (call->index >= (1 << CALL_INDEX_BITS))
+	{
+		call_free(bus, call);
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	int id = call_id(bus, call->index);
+	if (coro_bus_send(bus, channel, (unsigned)id) != 0)
+	{
+		call_free(bus, call);
+		return -1;
+	}
+	return id;
+}
+
+int coro_bus_call_wait(struct coro_bus* bus, int call_id, unsigned* resp)
+{
+	assert(bus);
+	struct coro_bus_call* call = call_get(bus, call_id);
+	if (!call || call->waiter)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	call->waiter = coro_this();
+	while (!call->is_done)
+		coro_suspend();
+	call->waiter = NULL;
+	enum coro_bus_error_code err = call->err;
+	*resp = call->resp;
+	call_free(bus, call);
+	coro_bus_errno_set(err);
+	return err == CORO_BUS_ERR_NONE ? 0 : -1;
+}
+
+int coro_bus_call(struct coro_bus* bus, int channel, unsigned req, unsigned* resp)
+{
+	int call = coro_bus_call_start(bus, channel, req);
+	if (call < 0)
+		return -1;
+	return coro_bus_call_wait(bus, call, resp);
+}
+
+int coro_bus_recv_call(struct coro_bus* bus, int channel, int* call_id, unsigned* req)
+{
+	unsigned id;
+	if (coro_bus_recv(bus, channel, &id) != 0)
+		return -1;
+	struct coro_bus_call* call = call_get(bus, (int)id);
+	assert(call && !call->is_taken);
+	call->is_taken = true;
+	rlist_del_entry(call, in_channel);
+	*call_id = (int)id;
+	*req = call->req;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_reply(struct coro_bus* bus, int call_id, unsigned resp)
+{
+	assert(bus);
+	struct coro_bus_call* call = call_get(bus, call_id);
+	if (!call || !call->is_taken || call->is_done)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	call->resp = resp;
+	call->is_done = true;
+	if (call->waiter)
+		coro_wakeup(call->waiter);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
 #if NEED_BROADCAST
 
 int coro_bus_try_broadcast(struct coro_bus* bus, unsigned data)
 {
     assert(bus);
-	bool has_channels = false;
-    for (int i = 0; i < bus->channel_count; ++i) 
-	{
-        if (bus->channels[i]) 
-		{
-            has_channels = true;
-            if (bus->channels[i]->data.size >= bus->channels[i]->data.capacity) 
-			{
-                coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-                return -1;
-            }
-        }
-    }
-    if (!has_channels) 
+	if (bus->channel_count == 0)
 	{
         coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
         return -1;
-    }
-    for (int i = 0; i < bus->channel_count; ++i) 
+	}
+	if (bus->full_count > 0)
 	{
-        if (bus->channels[i]) 
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+    for (int i = 0; i < bus->channels.count; ++i) 
+	{
+		struct coro_bus_channel* ch = desc_table_get(&bus->channels, i);
+        if (ch) 
 		{
-            data_vector_push_back(&bus->channels[i]->data, data);
-            wakeup_queue_wakeup_first(&bus->channels[i]->recv_queue);
+            channel_push(bus, ch, 0, data);
         }
     }
     coro_bus_errno_set(CORO_BUS_ERR_NONE);
@@ -326,45 +1390,400 @@ int coro_bus_broadcast(struct coro_bus *bus, unsigned data)
 	{
         int rc = coro_bus_try_broadcast(bus, data);
         if (rc == 0) 
+		{
+			/* Let the next broadcaster go if there is still space. */
+			if (bus->full_count == 0)
+				wakeup_queue_wakeup_first(&bus->broadcast_queue);
             return 0;
-        
+		}
         if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) 
             return -1;
-    
-        int active_channels = 0;
-        for (int i = 0; i < bus->channel_count; ++i) 
-		{
-            if (bus->channels[i]) 
-                ++active_channels;
-        }
-        if (active_channels == 0) 
+		wakeup_queue_suspend_this(&bus->broadcast_queue);
+    }
+}
+
+#endif
+
+static struct coro_bus_group* group_get(struct coro_bus* bus, int group)
+{
+	assert(bus);
+	struct coro_bus_group* g = desc_table_get(&bus->groups, group);
+	if (!g)
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return g;
+}
+
+static bool group_has_member(const struct coro_bus_group* group, int channel)
+{
+	size_t word = (size_t)channel / 64;
+	return word < group->word_count && (group->members[word] >> (channel % 64) & 1);
+}
+
+static void group_remove_member(struct coro_bus_group* group, int channel, bool is_full)
+{
+	assert(group_has_member(group, channel));
+	group->members[channel / 64] &= ~((uint64_t)1 << (channel % 64));
+	if (--group->member_count == 0)
+	{
+		/* They all fail now. */
+		group->full_count = 0;
+		wakeup_queue_wakeup_all(&group->send_queue);
+	}
+	else if (is_full)
+	{
+		group_on_member_not_full(group);
+	}
+}
+
+int coro_bus_group_open(struct coro_bus* bus)
+{
+	assert(bus);
+	struct coro_bus_group* group = (struct coro_bus_group*) malloc(sizeof(*group));
+	assert(group);
+	group->members = NULL;
+	group->word_count = 0;
+	group->member_count = 0;
+	group->full_count = 0;
+	rlist_create(&group->send_queue.coros);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return desc_table_alloc(&bus->groups, group);
+}
+
+void coro_bus_group_close(struct coro_bus* bus, int group_id)
+{
+	struct coro_bus_group* group = group_get(bus, group_id);
+	if (!group)
+		return;
+	wakeup_queue_drain(&group->send_queue);
+	for (size_t w = 0; w < group->word_count; ++w)
+	{
+		for (uint64_t bits = group->members[w]; bits != 0; bits &= bits - 1)
 		{
-            coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-            return -1;
-        }
+			int channel = (int)(w * 64 + __builtin_ctzll(bits));
+			struct coro_bus_channel* ch = desc_table_get(&bus->channels, channel);
+			for (int i = 0; i < ch->group_count; ++i)
+			{
+				if (ch->groups[i] == group_id)
+				{
+					ch->groups[i] = ch->groups[--ch->group_count];
+					break;
+				}
+			}
+		}
+	}
+	free(group->members);
+	free(group);
+	desc_table_free(&bus->groups, group_id);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+}
+
+int coro_bus_group_add(struct coro_bus* bus, int group_id, int channel)
+{
+	struct coro_bus_group* group = group_get(bus, group_id);
+	if (!group)
+		return -1;
+	struct coro_bus_channel* ch = channel_get(bus, channel);
+	if (!ch)
+		return -1;
+	if (group_has_member(group, channel))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return 0;
+	}
+	size_t word = (size_t)channel / 64;
+	if (word >= group->word_count)
+	{
+		size_t word_count = (word + 1) * 2;
+		group->members = (uint64_t*) realloc(group->members, word_count * sizeof(uint64_t));
+		memset(group->members + group->word_count, 0,
+			(word_count - group->word_count) * sizeof(uint64_t));
+		group->word_count = word_count;
+	}
+	if (ch->group_count == ch->group_capacity)
+	{
+		ch->group_capacity = (ch->group_capacity + 1) * 2;
+		ch->groups = (int*) realloc(ch->groups, ch->group_capacity * sizeof(int));
+	}
+	ch->groups[ch->group_count++] = group_id;
+	group->members[word] |= (uint64_t)1 << (channel % 64);
+	++group->member_count;
+	if (channel_is_full(ch))
+		++group->full_count;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
 
-		struct wakeup_entry* entries = (struct wakeup_entry*) malloc(active_channels * sizeof(struct wakeup_entry));;
-        int entries_count = 0;
-        for (int i = 0; i < bus->channel_count; ++i) 
+int coro_bus_group_remove(struct coro_bus* bus, int group_id, int channel)
+{
+	struct coro_bus_group* group = group_get(bus, group_id);
+	if (!group)
+		return -1;
+	struct coro_bus_channel* ch = channel_get(bus, channel);
+	if (!ch)
+		return -1;
+	if (group_has_member(group, channel))
+	{
+		for (int i = 0; i < ch->group_count; ++i)
 		{
-            if (bus->channels[i] && 
-                bus->channels[i]->data.size >= bus->channels[i]->data.capacity) 
+			if (ch->groups[i] == group_id)
 			{
-                entries[entries_count].coro = coro_this();
-                rlist_add_tail_entry(&bus->channels[i]->send_queue.coros, 
-                                    &entries[entries_count], base);
-                ++entries_count;
-            }
-        }
-        coro_suspend();
+				ch->groups[i] = ch->groups[--ch->group_count];
+				break;
+			}
+		}
+		group_remove_member(group, channel, channel_is_full(ch));
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
 
-        for (int i = 0; i < entries_count; ++i) 
-            rlist_del_entry(&entries[i], base);
-        free(entries);
-    }
+int coro_bus_try_multicast(struct coro_bus* bus, int group_id, unsigned data)
+{
+	struct coro_bus_group* group = group_get(bus, group_id);
+	if (!group)
+		return -1;
+	if (group->member_count == 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (group->full_count > 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	for (size_t w = 0; w < group->word_count; ++w)
+	{
+		for (uint64_t bits = group->members[w]; bits != 0; bits &= bits - 1)
+		{
+			int channel = (int)(w * 64 + __builtin_ctzll(bits));
+			channel_push(bus, desc_table_get(&bus->channels, channel), 0, data);
+		}
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
 }
 
-#endif
+int coro_bus_multicast(struct coro_bus* bus, int group_id, unsigned data)
+{
+	while (true)
+	{
+		if (coro_bus_try_multicast(bus, group_id, data) == 0)
+		{
+			struct coro_bus_group* group = desc_table_get(&bus->groups, group_id);
+			/* Let the next multicaster go if there is still space. */
+			if (group->full_count == 0)
+				wakeup_queue_wakeup_first(&group->send_queue);
+			return 0;
+		}
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return -1;
+		struct coro_bus_group* group = desc_table_get(&bus->groups, group_id);
+		wakeup_queue_suspend_this(&group->send_queue);
+	}
+}
+
+static struct coro_bus_topic* topic_get(struct coro_bus* bus, int topic)
+{
+	assert(bus);
+	struct coro_bus_topic* t = desc_table_get(&bus->topics, topic);
+	if (!t)
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return t;
+}
+
+static struct coro_bus_subscriber* subscriber_get(struct coro_bus* bus, int subscriber)
+{
+	assert(bus);
+	struct coro_bus_subscriber* sub = desc_table_get(&bus->subscribers, subscriber);
+	if (!sub)
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return sub;
+}
+
+/**
+ * Find the slowest subscribers again after the last one of them
+ * has moved on. Publishers are woken up if that freed a slot.
+ */
+static void topic_update_min_cursor(struct coro_bus_topic* topic)
+{
+	assert(topic);
+	if (topic->sub_count == 0)
+	{
+		topic->min_cursor = topic->head;
+		topic->min_count = 0;
+		wakeup_queue_wakeup_first(&topic->send_queue);
+		return;
+	}
+	uint64_t min = topic->head;
+	size_t count = 0;
+	for (size_t i = 0; i < topic->sub_count; ++i)
+	{
+		uint64_t cursor = topic->subs[i]->cursor;
+		if (cursor < min)
+		{
+			min = cursor;
+			count = 1;
+		}
+		else if (cursor == min)
+			++count;
+	}
+	bool is_freed = min > topic->min_cursor;
+	topic->min_cursor = min;
+	topic->min_count = count;
+	if (is_freed)
+		wakeup_queue_wakeup_first(&topic->send_queue);
+}
+
+int coro_bus_topic_open(struct coro_bus* bus, size_t size_limit)
+{
+	assert(bus);
+	struct coro_bus_topic* topic = (struct coro_bus_topic*) malloc(sizeof(*topic));
+	assert(topic);
+	topic->size_limit = size_limit;
+	topic->ring = (unsigned*) malloc(size_limit * sizeof(unsigned));
+	topic->head = 0;
+	topic->min_cursor = 0;
+	topic->min_count = 0;
+	topic->subs = NULL;
+	topic->sub_count = 0;
+	topic->sub_capacity = 0;
+	rlist_create(&topic->send_queue.coros);
+	rlist_create(&topic->recv_queue.coros);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return desc_table_alloc(&bus->topics, topic);
+}
+
+void coro_bus_topic_close(struct coro_bus* bus, int topic_id)
+{
+	struct coro_bus_topic* topic = topic_get(bus, topic_id);
+	if (!topic)
+		return;
+	wakeup_queue_drain(&topic->send_queue);
+	wakeup_queue_drain(&topic->recv_queue);
+	for (size_t i = 0; i < topic->sub_count; ++i)
+	{
+		desc_table_free(&bus->subscribers, topic->subs[i]->id);
+		free(topic->subs[i]);
+	}
+	free(topic->subs);
+	free(topic->ring);
+	free(topic);
+	desc_table_free(&bus->topics, topic_id);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+}
+
+int coro_bus_subscribe(struct coro_bus* bus, int topic_id)
+{
+	struct coro_bus_topic* topic = topic_get(bus, topic_id);
+	if (!topic)
+		return -1;
+	struct coro_bus_subscriber* sub = (struct coro_bus_subscriber*) malloc(sizeof(*sub));
+	assert(sub);
+	sub->topic = topic;
+	sub->cursor = topic->head;
+	if (topic->sub_count == 0 || topic->min_cursor == topic->head)
+	{
+		topic->min_cursor = topic->head;
+		++topic->min_count;
+	}
+	if (topic->sub_count == topic->sub_capacity)
+	{
+		topic->sub_capacity = (topic->sub_capacity + 1) * 2;
+		topic->subs = realloc(topic->subs, topic->sub_capacity * sizeof(void*));
+	}
+	sub->index = topic->sub_count;
+	topic->subs[topic->sub_count++] = sub;
+	sub->id = desc_table_alloc(&bus->subscribers, sub);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return sub->id;
+}
+
+void coro_bus_unsubscribe(struct coro_bus* bus, int subscriber)
+{
+	struct coro_bus_subscriber* sub = subscriber_get(bus, subscriber);
+	if (!sub)
+		return;
+	struct coro_bus_topic* topic = sub->topic;
+	struct coro_bus_subscriber* last = topic->subs[--topic->sub_count];
+	topic->subs[sub->index] = last;
+	last->index = sub->index;
+	if (sub->cursor == topic->min_cursor && --topic->min_count == 0)
+		topic_update_min_cursor(topic);
+	/* Wake up own waiters, they will see the subscriber is gone. */
+	wakeup_queue_wakeup_all(&topic->recv_queue);
+	desc_table_free(&bus->subscribers, subscriber);
+	free(sub);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+}
+
+int coro_bus_try_publish(struct coro_bus* bus, int topic_id, unsigned data)
+{
+	struct coro_bus_topic* topic = topic_get(bus, topic_id);
+	if (!topic)
+		return -1;
+	if (topic->sub_count == 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (topic->head - topic->min_cursor >= topic->size_limit)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	topic->ring[topic->head++ % topic->size_limit] = data;
+	wakeup_queue_wakeup_all(&topic->recv_queue);
+	/* The slowest subscriber might have freed more than one slot. */
+	if (topic->head - topic->min_cursor < topic->size_limit)
+		wakeup_queue_wakeup_first(&topic->send_queue);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_publish(struct coro_bus* bus, int topic_id, unsigned data)
+{
+	while (true)
+	{
+		if (coro_bus_try_publish(bus, topic_id, data) == 0)
+			return 0;
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return -1;
+		struct coro_bus_topic* topic = desc_table_get(&bus->topics, topic_id);
+		wakeup_queue_suspend_this(&topic->send_queue);
+	}
+}
+
+int coro_bus_try_consume(struct coro_bus* bus, int subscriber, unsigned* data)
+{
+	struct coro_bus_subscriber* sub = subscriber_get(bus, subscriber);
+	if (!sub)
+		return -1;
+	struct coro_bus_topic* topic = sub->topic;
+	if (sub->cursor == topic->head)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	*data = topic->ring[sub->cursor % topic->size_limit];
+	if (sub->cursor++ == topic->min_cursor && --topic->min_count == 0)
+		topic_update_min_cursor(topic);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_consume(struct coro_bus* bus, int subscriber, unsigned* data)
+{
+	while (true)
+	{
+		if (coro_bus_try_consume(bus, subscriber, data) == 0)
+			return 0;
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return -1;
+		struct coro_bus_subscriber* sub = desc_table_get(&bus->subscribers, subscriber);
+		wakeup_queue_suspend_this(&sub->topic->recv_queue);
+	}
+}
 
 #if NEED_BATCH
 
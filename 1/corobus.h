@@ -1,15 +1,29 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #define NEED_BROADCAST 1
 #define NEED_BATCH 0
 
+/**
+ * Per-channel telemetry. When 0, the counters are compiled out and
+ * cost nothing. Then coro_bus_channel_stats() fails with
+ * CORO_BUS_ERR_NOT_IMPLEMENTED.
+ */
+#ifndef CORO_BUS_STATS
+#define CORO_BUS_STATS 0
+#endif
+
 enum coro_bus_error_code {
 	CORO_BUS_ERR_NONE = 0,
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	CORO_BUS_ERR_TIMEOUT,
+	/** A system call failed, errno tells why. */
+	CORO_BUS_ERR_SYSTEM,
 };
 
 struct coro_bus;
@@ -40,6 +54,19 @@ void coro_bus_delete(struct coro_bus *bus);
  */
 int coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 
+/**
+ * Same as coro_bus_channel_open(), but the channel has several
+ * priority lanes. Each lane holds up to @a size_limit messages.
+ * A receive takes from the highest non-empty lane, so urgent
+ * messages don't wait behind the bulk ones. Plain send and
+ * broadcast use lane 0, the lowest.
+ * @param lane_count Number of lanes, > 0.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int coro_bus_channel_open_lanes(struct coro_bus *bus, size_t size_limit,
+	unsigned lane_count);
+
 /**
  * Destroy the channel identified by the given descriptor. The
  * channel must exist. All pending messages of the channel are
@@ -50,6 +77,105 @@ int coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
  */
 void coro_bus_channel_close(struct coro_bus *bus, int channel);
 
+/**
+ * Change the max number of messages in each lane of the channel.
+ * The messages and the waiters stay. When the limit is raised, the
+ * blocked senders are woken up. When it is lowered below the
+ * messages in the channel, nothing is dropped: the channel is full
+ * until the receivers take it under the new limit, and the memory
+ * is given back then.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int coro_bus_channel_set_limit(struct coro_bus *bus, int channel,
+	size_t size_limit);
+
+/**
+ * Let lane 0 of the channel overflow to disk. When its ring is
+ * full, the messages are appended to a file mapped into memory,
+ * and move back into the ring in order as it drains. The lane then
+ * doesn't block the senders nor count as full for broadcasts, unless
+ * the file can't grow anymore (the disk or RLIMIT_FSIZE is out).
+ * Then it is full as usual until the receivers free some room. The
+ * file is unlinked right away and shrinks back once it is empty.
+ * Can't be turned off, lasts until the channel is closed.
+ * @param dir Directory for the file, on a local disk.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_SYSTEM - the file could not be created.
+ */
+int coro_bus_channel_spill(struct coro_bus *bus, int channel,
+	const char *dir);
+
+/**
+ * Generation of the channel descriptor. Closed descriptors are
+ * reused by the next opened channels, and each reuse gets a new
+ * generation. A descriptor saved together with its generation can
+ * be checked for still pointing at the same channel.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ *
+ * @retval >0 Generation of the descriptor.
+ * @retval 0 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+unsigned coro_bus_channel_gen(struct coro_bus *bus, int channel);
+
+enum
+{
+	/**
+	 * Latency histogram size. Bucket i counts the latencies in
+	 * [2^i, 2^(i+1)) nanoseconds, the last one - everything longer.
+	 */
+	CORO_BUS_LATENCY_BUCKETS = 40,
+};
+
+struct coro_bus_channel_stats
+{
+	/** Messages put into the channel. */
+	uint64_t msg_in;
+	/** Messages taken from the channel. */
+	uint64_t msg_out;
+	/** Messages in the channel now. */
+	size_t depth;
+	/** The biggest depth ever seen. */
+	size_t depth_max;
+	/** How many times a sender had to wait for space. */
+	uint64_t send_block_count;
+	/** Total time senders spent waiting, in nanoseconds. */
+	uint64_t send_block_ns;
+	/** How many times a receiver had to wait for data. */
+	uint64_t recv_block_count;
+	/** Total time receivers spent waiting, in nanoseconds. */
+	uint64_t recv_block_ns;
+	/** Time between enqueue and dequeue of the messages. */
+	uint64_t latency_hist[CORO_BUS_LATENCY_BUCKETS];
+};
+
+/**
+ * Get the telemetry of the channel.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param[out] stats The counters.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - CORO_BUS_STATS is off.
+ */
+int coro_bus_channel_stats(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stats *stats);
+
+/**
+ * Print the telemetry of all the channels in the bus, a line per
+ * channel. Prints nothing when CORO_BUS_STATS is off.
+ */
+void coro_bus_stats_dump(struct coro_bus *bus, FILE *out);
+
 /**
  * Send the given message to the specified channel. If the channel
  * is full, the function should suspend the current coroutine and
@@ -110,6 +236,115 @@ int coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
  */
 int coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
 
+/**
+ * Same as coro_bus_send(), but into the given priority lane. It
+ * blocks only while that lane is full.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel or the lane doesn't
+ *       exist.
+ */
+int coro_bus_send_lane(struct coro_bus *bus, int channel, unsigned lane,
+	unsigned data);
+
+/**
+ * Same as coro_bus_send_lane(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel or the lane doesn't
+ *       exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the lane is full.
+ */
+int coro_bus_try_send_lane(struct coro_bus *bus, int channel, unsigned lane,
+	unsigned data);
+
+/**
+ * Same as coro_bus_send(), but waits for space at most
+ * @a timeout_ns nanoseconds. The scheduler sleeps meanwhile if
+ * nothing else is runnable.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed full.
+ */
+int coro_bus_send_timeout(struct coro_bus *bus, int channel, unsigned data,
+	uint64_t timeout_ns);
+
+/**
+ * Same as coro_bus_recv(), but waits for a message at most
+ * @a timeout_ns nanoseconds. The scheduler sleeps meanwhile if
+ * nothing else is runnable.
+ *
+ * @retval 0 Success. Data output is filled with the received
+ *     message.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed empty.
+ */
+int coro_bus_recv_timeout(struct coro_bus *bus, int channel, unsigned *data,
+	uint64_t timeout_ns);
+
+
+/**
+ * Request/response on top of a channel. The caller sends a
+ * request and sleeps until a server replies, without a reply
+ * channel. The messages in a call channel are call descriptors,
+ * it must be read only with coro_bus_recv_call().
+ */
+
+/**
+ * Send a request without waiting for the reply. Many calls can be
+ * in flight at once. Each must be finished with
+ * coro_bus_call_wait(). Blocks while the channel is full.
+ *
+ * @retval >=0 Descriptor of the call. It carries a generation, so
+ *     the descriptor of a finished call never matches a later one.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - too many calls, about a million,
+ *       are in flight.
+ */
+int coro_bus_call_start(struct coro_bus *bus, int channel, unsigned req);
+
+/**
+ * Wait for the reply to the call and free the call.
+ * @param[out] resp The reply.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the call doesn't exist, or the
+ *       channel was closed before a server took the request.
+ */
+int coro_bus_call_wait(struct coro_bus *bus, int call, unsigned *resp);
+
+/** Same as coro_bus_call_start() + coro_bus_call_wait(). */
+int coro_bus_call(struct coro_bus *bus, int channel, unsigned req,
+	unsigned *resp);
+
+/**
+ * Receive a request, blocking while there are none.
+ * @param[out] call Descriptor of the call to reply to.
+ * @param[out] req The request.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int coro_bus_recv_call(struct coro_bus *bus, int channel, int *call,
+	unsigned *req);
+
+/**
+ * Reply to the received call and wake up the caller.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the call doesn't exist or is
+ *       answered already.
+ */
+int coro_bus_reply(struct coro_bus *bus, int call, unsigned resp);
 
 #if NEED_BROADCAST 
 
@@ -140,7 +375,180 @@ int coro_bus_broadcast(struct coro_bus *bus, unsigned data);
  */
 int coro_bus_try_broadcast(struct coro_bus *bus, unsigned data);
 
-#endif 
+#endif
+
+/**
+ * Multicast groups. A group is a set of channels which can be
+ * sent to at once, like a broadcast to a part of the bus. A
+ * channel can be in any number of groups. A closed channel leaves
+ * all its groups.
+ */
+
+/**
+ * Create an empty multicast group inside the bus.
+ * @retval >=0 Descriptor of the group.
+ */
+int coro_bus_group_open(struct coro_bus *bus);
+
+/**
+ * Destroy the group. The channels stay open. All the coroutines
+ * suspended on this group are woken up and get the error that
+ * the channel is missing.
+ */
+void coro_bus_group_close(struct coro_bus *bus, int group);
+
+/**
+ * Add the channel to the group. Adding a member again is a nop.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the group or the channel doesn't
+ *       exist.
+ */
+int coro_bus_group_add(struct coro_bus *bus, int group, int channel);
+
+/**
+ * Remove the channel from the group. Removing a non-member is a
+ * nop.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the group or the channel doesn't
+ *       exist.
+ */
+int coro_bus_group_remove(struct coro_bus *bus, int group, int channel);
+
+/**
+ * Same as coro_bus_broadcast(), but sends only to the members of
+ * the group.
+ *
+ * @retval 0 Success. Sent to all the members.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the group doesn't exist or has no
+ *       members.
+ */
+int coro_bus_multicast(struct coro_bus *bus, int group, unsigned data);
+
+/**
+ * Same as coro_bus_multicast(), but if any of the members are
+ * full, it instantly returns, not suspends.
+ *
+ * @retval 0 Success. Sent to all the members.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the group doesn't exist or has no
+ *       members.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - at least one member is full.
+ */
+int coro_bus_try_multicast(struct coro_bus *bus, int group, unsigned data);
+
+/**
+ * Topics are the publish/subscribe alternative to broadcast. A
+ * topic has a single ring of messages shared by all of its
+ * subscribers. Each subscriber only remembers its own read
+ * position in the ring. So publishing costs one write regardless
+ * of the subscriber count. The slowest subscriber limits how far
+ * the publishers can go ahead.
+ */
+
+/**
+ * Create a topic inside the bus.
+ * @param bus The bus to create the topic in.
+ * @param size_limit Maximum messages the topic can hold for its
+ *     slowest subscriber.
+ *
+ * @retval >=0 Descriptor of the topic. It must be passed to the
+ *     publish/subscribe functions.
+ */
+int coro_bus_topic_open(struct coro_bus *bus, size_t size_limit);
+
+/**
+ * Destroy the topic identified by the given descriptor together
+ * with all its subscribers. All the coroutines suspended on this
+ * topic are woken up and get the error that the channel is
+ * missing.
+ * @param bus Bus to destroy the topic in.
+ * @param topic Descriptor of the topic to destroy.
+ */
+void coro_bus_topic_close(struct coro_bus *bus, int topic);
+
+/**
+ * Subscribe to the topic. The subscriber receives only the
+ * messages published after the subscription.
+ * @param bus Bus where the topic is located.
+ * @param topic Descriptor of the topic to subscribe to.
+ *
+ * @retval >=0 Descriptor of the subscriber. It must be passed to
+ *     the consume functions.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the topic doesn't exist.
+ */
+int coro_bus_subscribe(struct coro_bus *bus, int topic);
+
+/**
+ * Drop the subscriber. Its unread messages are not holding the
+ * publishers anymore.
+ * @param bus Bus where the subscriber is located.
+ * @param subscriber Descriptor of the subscriber.
+ */
+void coro_bus_unsubscribe(struct coro_bus *bus, int subscriber);
+
+/**
+ * Publish the message to all the subscribers of the topic. If the
+ * slowest subscriber has the topic full, the coroutine is
+ * suspended until it consumes something.
+ * @param bus Bus where the topic is located.
+ * @param topic Descriptor of the topic.
+ * @param data Data to publish.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the topic doesn't exist or has
+ *       no subscribers.
+ */
+int coro_bus_publish(struct coro_bus *bus, int topic, unsigned data);
+
+/**
+ * Same as coro_bus_publish(), but if the topic is full, the
+ * function immediately returns.
+ * @param bus Bus where the topic is located.
+ * @param topic Descriptor of the topic.
+ * @param data Data to publish.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the topic doesn't exist or has
+ *       no subscribers.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the topic is full.
+ */
+int coro_bus_try_publish(struct coro_bus *bus, int topic, unsigned data);
+
+/**
+ * Read the next message of the topic for this subscriber. If
+ * there are none, the coroutine is suspended until something is
+ * published or the topic is gone.
+ * @param bus Bus where the subscriber is located.
+ * @param subscriber Descriptor of the subscriber.
+ * @param data Output parameter to save the data to.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the subscriber doesn't exist.
+ */
+int coro_bus_consume(struct coro_bus *bus, int subscriber, unsigned *data);
+
+/**
+ * Same as coro_bus_consume(), but if there are no new messages,
+ * the function immediately returns.
+ * @param bus Bus where the subscriber is located.
+ * @param subscriber Descriptor of the subscriber.
+ * @param data Output parameter to save the data to.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the subscriber doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - no new messages.
+ */
+int coro_bus_try_consume(struct coro_bus *bus, int subscriber, unsigned *data);
 
 #if NEED_BATCH 
 
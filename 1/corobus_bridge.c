@@ -0,0 +1,338 @@
+#include "corobus_bridge.h"
+
+#include "libcoro.h"
+#include "rlist.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * A frame is a header followed by the messages. All the numbers
+ * are 32 bit in the network byte order.
+ */
+struct bridge_frame_header
+{
+	/** Descriptor of the channel in the receiving bus. */
+	uint32_t channel;
+	/** Number of messages after the header. */
+	uint32_t count;
+};
+
+enum
+{
+	/** Max messages in a frame. */
+	BRIDGE_BATCH = 256,
+	BRIDGE_FRAME_MAX = sizeof(struct bridge_frame_header) + BRIDGE_BATCH * sizeof(uint32_t),
+	/**
+	 * Bytes not yet written into the socket. When the buffer is
+	 * full, the routes stop taking messages from the channels.
+	 */
+	BRIDGE_OUT_LIMIT = 64 * 1024,
+	BRIDGE_IN_SIZE = 64 * 1024,
+};
+
+/** A coroutine waiting for something in the bridge. */
+struct bridge_waiter
+{
+	struct rlist base;
+	struct coro* coro;
+};
+
+struct bridge_route
+{
+	struct rlist base;
+	struct coro_bus_bridge* bridge;
+	int local_channel;
+	uint32_t remote_channel;
+	struct coro* worker;
+};
+
+struct coro_bus_bridge
+{
+	struct coro_bus* bus;
+	int fd;
+	/** Set by delete. The writer exits when flushed everything. */
+	bool is_stopped;
+	/** The socket failed. Everything sent is dropped from now on. */
+	bool is_broken;
+
+	/** Output bytes are in [out_begin, out_end). */
+	char* out;
+	size_t out_begin;
+	size_t out_end;
+	/** Routes waiting for space in the output buffer. */
+	struct rlist out_waiters;
+
+	struct coro* writer;
+	/** The writer is suspended, waiting for output. */
+	bool is_writer_idle;
+	struct coro* reader;
+	struct rlist routes;
+};
+
+static void bridge_wakeup_all(struct rlist* waiters)
+{
+	struct bridge_waiter* w;
+	rlist_foreach_entry(w, waiters, base)
+		coro_wakeup(w->coro);
+}
+
+static void bridge_wait(struct rlist* waiters)
+{
+	struct bridge_waiter w;
+	w.coro = coro_this();
+	rlist_add_tail_entry(waiters, &w, base);
+	coro_suspend();
+	rlist_del_entry(&w, base);
+}
+
+/**
+ * The peer is gone or talks nonsense. Drop the output, and let the
+ * blocked routes and the writer see it.
+ */
+static void bridge_break(struct coro_bus_bridge* bridge)
+{
+	bridge->is_broken = true;
+	bridge->out_begin = bridge->out_end = 0;
+	bridge_wakeup_all(&bridge->out_waiters);
+	if (bridge->is_writer_idle)
+		coro_wakeup(bridge->writer);
+}
+
+static void* bridge_writer_f(void* arg)
+{
+	struct coro_bus_bridge* bridge = (struct coro_bus_bridge*) arg;
+	while (!bridge->is_broken)
+	{
+		if (bridge->out_begin == bridge->out_end)
+		{
+			if (bridge->is_stopped)
+				break;
+			bridge->is_writer_idle = true;
+			coro_suspend();
+			bridge->is_writer_idle = false;
+			continue;
+		}
+		/* A closed peer must not SIGPIPE the whole process. */
+		ssize_t rc = send(bridge->fd, bridge->out + bridge->out_begin,
+			bridge->out_end - bridge->out_begin, MSG_NOSIGNAL);
+		if (rc > 0)
+		{
+			bridge->out_begin += rc;
+			if (bridge->out_begin == bridge->out_end)
+				bridge->out_begin = bridge->out_end = 0;
+			bridge_wakeup_all(&bridge->out_waiters);
+			continue;
+		}
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			coro_wait_fd(bridge->fd, POLLOUT);
+			continue;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		/* EPIPE, ECONNRESET and the like. */
+		bridge_break(bridge);
+	}
+	return NULL;
+}
+
+/** Append a frame to the output, waiting for space if needed. */
+static void bridge_put_frame(struct coro_bus_bridge* bridge, uint32_t channel, const unsigned* data, uint32_t count)
+{
+	size_t size = sizeof(struct bridge_frame_header) + count * sizeof(uint32_t);
+	while (!bridge->is_broken && BRIDGE_OUT_LIMIT - (bridge->out_end - bridge->out_begin) < size)
+		bridge_wait(&bridge->out_waiters);
+	if (bridge->is_broken)
+		return;
+	if (BRIDGE_OUT_LIMIT - bridge->out_end < size)
+	{
+		memmove(bridge->out, bridge->out + bridge->out_begin, bridge->out_end - bridge->out_begin);
+		bridge->out_end -= bridge->out_begin;
+		bridge->out_begin = 0;
+	}
+	struct bridge_frame_header header;
+	header.channel = htonl(channel);
+	header.count = htonl(count);
+	memcpy(bridge->out + bridge->out_end, &header, sizeof(header));
+	bridge->out_end += sizeof(header);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t value = htonl(data[i]);
+		memcpy(bridge->out + bridge->out_end, &value, sizeof(value));
+		bridge->out_end += sizeof(value);
+	}
+	if (bridge->is_writer_idle)
+		coro_wakeup(bridge->writer);
+}
+
+static void* bridge_route_f(void* arg)
+{
+	struct bridge_route* route = (struct bridge_route*) arg;
+	struct coro_bus_bridge* bridge = route->bridge;
+	unsigned batch[BRIDGE_BATCH];
+	while (coro_bus_recv(bridge->bus, route->local_channel, &batch[0]) == 0)
+	{
+		uint32_t count = 1;
+		while (count < BRIDGE_BATCH &&
+			coro_bus_try_recv(bridge->bus, route->local_channel, &batch[count]) == 0)
+			++count;
+		bridge_put_frame(bridge, route->remote_channel, batch, count);
+	}
+	return NULL;
+}
+
+/** Deliver the messages of a frame into the local channel. */
+static void bridge_deliver(struct coro_bus_bridge* bridge, const char* frame)
+{
+	struct bridge_frame_header header;
+	memcpy(&header, frame, sizeof(header));
+	int channel = (int)ntohl(header.channel);
+	uint32_t count = ntohl(header.count);
+	const char* pos = frame + sizeof(header);
+	for (uint32_t i = 0; i < count; ++i, pos += sizeof(uint32_t))
+	{
+		uint32_t value;
+		memcpy(&value, pos, sizeof(value));
+		/* Blocks on a full channel, and so stops reading the socket. */
+		if (coro_bus_send(bridge->bus, channel, ntohl(value)) != 0)
+			return;
+	}
+}
+
+static void* bridge_reader_f(void* arg)
+{
+	struct coro_bus_bridge* bridge = (struct coro_bus_bridge*) arg;
+	char* in = (char*) malloc(BRIDGE_IN_SIZE);
+	size_t begin = 0;
+	size_t end = 0;
+	while (!bridge->is_stopped && !bridge->is_broken)
+	{
+		while (end - begin >= sizeof(struct bridge_frame_header))
+		{
+			struct bridge_frame_header header;
+			memcpy(&header, in + begin, sizeof(header));
+			uint32_t count = ntohl(header.count);
+			if (count > BRIDGE_BATCH)
+			{
+				/* Not a peer bridge. Stop talking to it. */
+				bridge_break(bridge);
+				break;
+			}
+			size_t size = sizeof(header) + count * sizeof(uint32_t);
+			if (end - begin < size)
+				break;
+			bridge_deliver(bridge, in + begin);
+			begin += size;
+		}
+		if (bridge->is_broken)
+			break;
+		if (begin == end)
+		{
+			begin = end = 0;
+		}
+		else if (BRIDGE_IN_SIZE - end < BRIDGE_FRAME_MAX)
+		{
+			memmove(in, in + begin, end - begin);
+			end -= begin;
+			begin = 0;
+		}
+		ssize_t rc = read(bridge->fd, in + end, BRIDGE_IN_SIZE - end);
+		if (rc > 0)
+		{
+			end += rc;
+			continue;
+		}
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			coro_wait_fd(bridge->fd, POLLIN);
+			continue;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		/* EOF or an error, the peer is gone. */
+		if (!bridge->is_stopped)
+			bridge_break(bridge);
+		break;
+	}
+	free(in);
+	return NULL;
+}
+
+struct coro_bus_bridge* coro_bus_bridge_new(struct coro_bus* bus, int fd)
+{
+	assert(bus);
+	int flags = fcntl(fd, F_GETFL);
+	assert(flags >= 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	/*
+	 * The messages are batched already, don't let Nagle hold the
+	 * frames. Fails on non-TCP sockets, which is fine.
+	 */
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	struct coro_bus_bridge* bridge = (struct coro_bus_bridge*) malloc(sizeof(*bridge));
+	assert(bridge);
+	bridge->bus = bus;
+	bridge->fd = fd;
+	bridge->is_stopped = false;
+	bridge->is_broken = false;
+	bridge->out = (char*) malloc(BRIDGE_OUT_LIMIT);
+	bridge->out_begin = 0;
+	bridge->out_end = 0;
+	rlist_create(&bridge->out_waiters);
+	bridge->is_writer_idle = false;
+	rlist_create(&bridge->routes);
+	bridge->writer = coro_new(bridge_writer_f, bridge);
+	bridge->reader = coro_new(bridge_reader_f, bridge);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return bridge;
+}
+
+int coro_bus_bridge_route(struct coro_bus_bridge* bridge, int local_channel, int remote_channel)
+{
+	assert(bridge);
+	assert(remote_channel >= 0);
+	if (coro_bus_channel_gen(bridge->bus, local_channel) == 0)
+		return -1;
+	struct bridge_route* route = (struct bridge_route*) malloc(sizeof(*route));
+	assert(route);
+	route->bridge = bridge;
+	route->local_channel = local_channel;
+	route->remote_channel = (uint32_t)remote_channel;
+	route->worker = coro_new(bridge_route_f, route);
+	rlist_add_tail_entry(&bridge->routes, route, base);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+void coro_bus_bridge_delete(struct coro_bus_bridge* bridge)
+{
+	assert(bridge);
+	while (!rlist_empty(&bridge->routes))
+	{
+		struct bridge_route* route = rlist_shift_entry(&bridge->routes, struct bridge_route, base);
+		coro_join(route->worker);
+		free(route);
+	}
+	assert(rlist_empty(&bridge->out_waiters));
+	bridge->is_stopped = true;
+	if (bridge->is_writer_idle)
+		coro_wakeup(bridge->writer);
+	coro_join(bridge->writer);
+	coro_wakeup(bridge->reader);
+	coro_join(bridge->reader);
+	free(bridge->out);
+	free(bridge);
+}
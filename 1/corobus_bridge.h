@@ -0,0 +1,55 @@
+#pragma once
+
+#include "corobus.h"
+
+/**
+ * Bridge between buses in different processes or hosts, over a
+ * connected stream socket. A local channel is routed to a channel
+ * of the remote bus: whatever is sent or broadcast into the local
+ * one, is delivered into the remote one, in order.
+ *
+ * Messages taken from a local channel at once go in one frame.
+ * When the remote channel is full, the remote side stops reading
+ * the socket, and the senders here get blocked once the socket
+ * and the local channel are full too.
+ *
+ * When the peer disconnects, the bridge breaks. Whatever is routed
+ * into it from then on is dropped, so the local senders don't get
+ * stuck on a dead connection.
+ *
+ * The bridge works in coroutines of the current engine. The
+ * socket is switched to the non-blocking mode and waited for via
+ * coro_wait_fd().
+ */
+
+struct coro_bus_bridge;
+
+/**
+ * Create a bridge over the connected socket. Each side of the
+ * connection needs its own bridge. The socket stays owned by the
+ * caller, and must stay open until the bridge is deleted.
+ */
+struct coro_bus_bridge* coro_bus_bridge_new(struct coro_bus *bus, int fd);
+
+/**
+ * Route the local channel to the remote one. The local channel
+ * becomes an outbox, nobody else should receive from it. Close
+ * the local channel to stop the routing.
+ * @param local_channel Descriptor of the channel in this bus.
+ * @param remote_channel Descriptor of the channel in the remote
+ *     bus. Messages to a missing remote channel are dropped.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the local channel doesn't exist.
+ */
+int coro_bus_bridge_route(struct coro_bus_bridge *bridge, int local_channel,
+	int remote_channel);
+
+/**
+ * Flush the pending messages into the socket and free the bridge.
+ * The routed local channels must be closed by now. The remote
+ * messages are delivered until the call, so the local channels
+ * they go into must have space or be closed.
+ */
+void coro_bus_bridge_delete(struct coro_bus_bridge *bridge);
@@ -0,0 +1,382 @@
+#include "corobus_mt.h"
+
+#include "libcoro.h"
+#include "rlist.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CACHE_LINE_SIZE 64
+
+/**
+ * A cell of the MPMC ring. The sequence number tells whether the
+ * cell is free for the sender at position pos (seq = 2 * pos), or
+ * holds data for the receiver at that position (seq = 2 * pos + 1).
+ * Doubling keeps the two states apart even in a ring of one cell.
+ */
+struct mt_cell
+{
+	_Atomic uint64_t seq;
+	unsigned data;
+};
+
+/**
+ * A coroutine or a thread waiting on the channel. Lives on the
+ * waiter's stack. Is only touched under the channel mutex.
+ */
+struct mt_waiter
+{
+	struct rlist base;
+	/** NULL when the waiter is a thread outside of coroutines. */
+	struct coro* coro;
+	bool is_woken;
+};
+
+struct mt_wait_queue
+{
+	struct rlist waiters;
+	/**
+	 * Number of registered waiters. Lets the fast path skip the
+	 * mutex when nobody waits.
+	 */
+	atomic_size_t count;
+};
+
+struct coro_bus_mt_channel
+{
+	enum coro_bus_mt_type type;
+	size_t size_limit;
+	atomic_bool is_closed;
+
+	/** SPSC ring. */
+	unsigned* ring;
+	/** MPMC ring. */
+	struct mt_cell* cells;
+
+	/**
+	 * Position of the next message to receive. The senders and the
+	 * receivers work on different cache lines.
+	 */
+	char pad_head[CACHE_LINE_SIZE];
+	_Atomic uint64_t head;
+	/** Position of the next message to send. */
+	char pad_tail[CACHE_LINE_SIZE];
+	_Atomic uint64_t tail;
+	char pad_end[CACHE_LINE_SIZE];
+
+	pthread_mutex_t mutex;
+	/** Threads outside of coroutines wait on it. */
+	pthread_cond_t cond;
+	struct mt_wait_queue send_queue;
+	struct mt_wait_queue recv_queue;
+};
+
+struct coro_bus_mt_channel* coro_bus_mt_channel_new(size_t size_limit, enum coro_bus_mt_type type)
+{
+	assert(size_limit > 0);
+	struct coro_bus_mt_channel* ch = (struct coro_bus_mt_channel*) malloc(sizeof(*ch));
+	assert(ch);
+	ch->type = type;
+	ch->size_limit = size_limit;
+	atomic_init(&ch->is_closed, false);
+	atomic_init(&ch->head, 0);
+	atomic_init(&ch->tail, 0);
+	ch->ring = NULL;
+	ch->cells = NULL;
+	if (type == CORO_BUS_MT_SPSC)
+	{
+		ch->ring = (unsigned*) malloc(size_limit * sizeof(unsigned));
+	}
+	else
+	{
+		ch->cells = (struct mt_cell*) malloc(size_limit * sizeof(struct mt_cell));
+		for (size_t i = 0; i < size_limit; ++i)
+			atomic_init(&ch->cells[i].seq, 2 * i);
+	}
+	pthread_mutex_init(&ch->mutex, NULL);
+	pthread_cond_init(&ch->cond, NULL);
+	rlist_create(&ch->send_queue.waiters);
+	atomic_init(&ch->send_queue.count, 0);
+	rlist_create(&ch->recv_queue.waiters);
+	atomic_init(&ch->recv_queue.count, 0);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return ch;
+}
+
+void coro_bus_mt_channel_delete(struct coro_bus_mt_channel* ch)
+{
+	assert(ch);
+	assert(rlist_empty(&ch->send_queue.waiters));
+	assert(rlist_empty(&ch->recv_queue.waiters));
+	pthread_mutex_destroy(&ch->mutex);
+	pthread_cond_destroy(&ch->cond);
+	free(ch->ring);
+	free(ch->cells);
+	free(ch);
+}
+
+/** Wake up a waiter. Must be called under the channel mutex. */
+static void mt_waiter_wakeup(struct coro_bus_mt_channel* ch, struct mt_waiter* w)
+{
+	rlist_del_entry(w, base);
+	w->is_woken = true;
+	if (w->coro)
+		coro_wakeup_remote(w->coro);
+	else
+		pthread_cond_broadcast(&ch->cond);
+}
+
+static void mt_wakeup_first(struct coro_bus_mt_channel* ch, struct mt_wait_queue* queue)
+{
+	/* Pairs with the fence in mt_wait_begin(). */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&queue->count, memory_order_relaxed) == 0)
+		return;
+	pthread_mutex_lock(&ch->mutex);
+	if (!rlist_empty(&queue->waiters))
+		mt_waiter_wakeup(ch, rlist_first_entry(&queue->waiters, struct mt_waiter, base));
+	pthread_mutex_unlock(&ch->mutex);
+}
+
+static void mt_wakeup_all(struct coro_bus_mt_channel* ch, struct mt_wait_queue* queue)
+{
+	while (!rlist_empty(&queue->waiters))
+		mt_waiter_wakeup(ch, rlist_first_entry(&queue->waiters, struct mt_waiter, base));
+}
+
+void coro_bus_mt_channel_close(struct coro_bus_mt_channel* ch)
+{
+	assert(ch);
+	atomic_store(&ch->is_closed, true);
+	pthread_mutex_lock(&ch->mutex);
+	mt_wakeup_all(ch, &ch->send_queue);
+	mt_wakeup_all(ch, &ch->recv_queue);
+	pthread_cond_broadcast(&ch->cond);
+	pthread_mutex_unlock(&ch->mutex);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+}
+
+/**
+ * Register the waiter before the last check of the ring. Then the
+ * peer either sees the waiter, or the waiter sees the peer's
+ * change in the ring.
+ */
+static void mt_wait_begin(struct coro_bus_mt_channel* ch, struct mt_wait_queue* queue, struct mt_waiter* w)
+{
+	w->coro = coro_this();
+	w->is_woken = false;
+	pthread_mutex_lock(&ch->mutex);
+	rlist_add_tail_entry(&queue->waiters, w, base);
+	atomic_fetch_add(&queue->count, 1);
+	pthread_mutex_unlock(&ch->mutex);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void mt_wait(struct coro_bus_mt_channel* ch, struct mt_waiter* w)
+{
+	if (w->coro)
+	{
+		coro_suspend_remote();
+		return;
+	}
+	pthread_mutex_lock(&ch->mutex);
+	while (!w->is_woken && !atomic_load(&ch->is_closed))
+		pthread_cond_wait(&ch->cond, &ch->mutex);
+	pthread_mutex_unlock(&ch->mutex);
+}
+
+/** @retval Whether the waiter was woken up by a peer. */
+static bool mt_wait_end(struct coro_bus_mt_channel* ch, struct mt_wait_queue* queue, struct mt_waiter* w)
+{
+	pthread_mutex_lock(&ch->mutex);
+	if (!w->is_woken)
+		rlist_del_entry(w, base);
+	bool is_woken = w->is_woken;
+	atomic_fetch_sub(&queue->count, 1);
+	pthread_mutex_unlock(&ch->mutex);
+	return is_woken;
+}
+
+static bool mt_has_data(struct coro_bus_mt_channel* ch)
+{
+	uint64_t head = atomic_load_explicit(&ch->head, memory_order_relaxed);
+	if (ch->type == CORO_BUS_MT_SPSC)
+		return head != atomic_load_explicit(&ch->tail, memory_order_acquire);
+	struct mt_cell* cell = &ch->cells[head % ch->size_limit];
+	return atomic_load_explicit(&cell->seq, memory_order_acquire) == 2 * head + 1;
+}
+
+static bool mt_has_space(struct coro_bus_mt_channel* ch)
+{
+	uint64_t tail = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+	if (ch->type == CORO_BUS_MT_SPSC)
+		return tail - atomic_load_explicit(&ch->head, memory_order_acquire) < ch->size_limit;
+	struct mt_cell* cell = &ch->cells[tail % ch->size_limit];
+	return atomic_load_explicit(&cell->seq, memory_order_acquire) == 2 * tail;
+}
+
+static bool spsc_push(struct coro_bus_mt_channel* ch, unsigned data)
+{
+	uint64_t tail = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&ch->head, memory_order_acquire);
+	if (tail - head >= ch->size_limit)
+		return false;
+	ch->ring[tail % ch->size_limit] = data;
+	atomic_store_explicit(&ch->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+static bool spsc_pop(struct coro_bus_mt_channel* ch, unsigned* data)
+{
+	uint64_t head = atomic_load_explicit(&ch->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ch->tail, memory_order_acquire);
+	if (head == tail)
+		return false;
+	*data = ch->ring[head % ch->size_limit];
+	atomic_store_explicit(&ch->head, head + 1, memory_order_release);
+	return true;
+}
+
+static bool mpmc_push(struct coro_bus_mt_channel* ch, unsigned data)
+{
+	uint64_t pos = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+	while (true)
+	{
+		struct mt_cell* cell = &ch->cells[pos % ch->size_limit];
+		uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		int64_t diff = (int64_t)(seq - 2 * pos);
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&ch->tail, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed))
+			{
+				cell->data = data;
+				atomic_store_explicit(&cell->seq, 2 * pos + 1, memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+	}
+}
+
+static bool mpmc_pop(struct coro_bus_mt_channel* ch, unsigned* data)
+{
+	uint64_t pos = atomic_load_explicit(&ch->head, memory_order_relaxed);
+	while (true)
+	{
+		struct mt_cell* cell = &ch->cells[pos % ch->size_limit];
+		uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		int64_t diff = (int64_t)(seq - (2 * pos + 1));
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&ch->head, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed))
+			{
+				*data = cell->data;
+				atomic_store_explicit(&cell->seq, 2 * (pos + ch->size_limit), memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = atomic_load_explicit(&ch->head, memory_order_relaxed);
+	}
+}
+
+int coro_bus_mt_try_send(struct coro_bus_mt_channel* ch, unsigned data)
+{
+	assert(ch);
+	if (atomic_load_explicit(&ch->is_closed, memory_order_relaxed))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	bool ok = ch->type == CORO_BUS_MT_SPSC ? spsc_push(ch, data) : mpmc_push(ch, data);
+	if (!ok)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	mt_wakeup_first(ch, &ch->recv_queue);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_mt_try_recv(struct coro_bus_mt_channel* ch, unsigned* data)
+{
+	assert(ch);
+	if (atomic_load_explicit(&ch->is_closed, memory_order_relaxed))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	bool ok = ch->type == CORO_BUS_MT_SPSC ? spsc_pop(ch, data) : mpmc_pop(ch, data);
+	if (!ok)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	mt_wakeup_first(ch, &ch->send_queue);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_mt_send(struct coro_bus_mt_channel* ch, unsigned data)
+{
+	while (true)
+	{
+		if (coro_bus_mt_try_send(ch, data) == 0)
+			return 0;
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return -1;
+		struct mt_waiter w;
+		mt_wait_begin(ch, &ch->send_queue, &w);
+		int rc = coro_bus_mt_try_send(ch, data);
+		if (rc != 0 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK)
+			mt_wait(ch, &w);
+		enum coro_bus_error_code err = coro_bus_errno();
+		/*
+		 * The wakeup might have been meant for another sender.
+		 * Pass it on if this one did not need it.
+		 */
+		if (mt_wait_end(ch, &ch->send_queue, &w) && rc == 0 && mt_has_space(ch))
+			mt_wakeup_first(ch, &ch->send_queue);
+		coro_bus_errno_set(err);
+		if (rc == 0 || err == CORO_BUS_ERR_NO_CHANNEL)
+			return rc;
+	}
+}
+
+int coro_bus_mt_recv(struct coro_bus_mt_channel* ch, unsigned* data)
+{
+	while (true)
+	{
+		if (coro_bus_mt_try_recv(ch, data) == 0)
+			return 0;
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return -1;
+		struct mt_waiter w;
+		mt_wait_begin(ch, &ch->recv_queue, &w);
+		int rc = coro_bus_mt_try_recv(ch, data);
+		if (rc != 0 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK)
+			mt_wait(ch, &w);
+		enum coro_bus_error_code err = coro_bus_errno();
+		/*
+		 * The wakeup might have been meant for another receiver.
+		 * Pass it on if this one did not need it.
+		 */
+		if (mt_wait_end(ch, &ch->recv_queue, &w) && rc == 0 && mt_has_data(ch))
+			mt_wakeup_first(ch, &ch->recv_queue);
+		coro_bus_errno_set(err);
+		if (rc == 0 || err == CORO_BUS_ERR_NO_CHANNEL)
+			return rc;
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "corobus.h"
+
+/**
+ * Thread-safe channels. Unlike the bus channels they can be used
+ * from any thread, including the ones not running a coroutine
+ * engine. Messages go through lock-free rings. A mutex is taken
+ * only to park or wake up a waiter.
+ *
+ * A coroutine blocked on a channel is suspended and woken up by
+ * its own engine, whichever thread the peer runs in. A thread
+ * outside of any coroutine is blocked on a condition variable.
+ *
+ * Errors are reported via coro_bus_errno(), which is per-thread.
+ */
+
+enum coro_bus_mt_type
+{
+	/** Exactly one sender thread and one receiver thread. */
+	CORO_BUS_MT_SPSC,
+	/** Any number of senders and receivers. */
+	CORO_BUS_MT_MPMC,
+};
+
+struct coro_bus_mt_channel;
+
+/**
+ * Create a thread-safe channel.
+ * @param size_limit Maximum messages a channel can hold at once.
+ *     Must be > 0.
+ * @param type Which ring to use. SPSC is cheaper when there is
+ *     one sender and one receiver.
+ */
+struct coro_bus_mt_channel* coro_bus_mt_channel_new(size_t size_limit, enum coro_bus_mt_type type);
+
+/**
+ * Close the channel. All pending messages are lost. All the
+ * waiters are woken up and get the error that the channel is
+ * missing, so are all the later calls. The object stays valid
+ * until coro_bus_mt_channel_delete().
+ */
+void coro_bus_mt_channel_close(struct coro_bus_mt_channel* ch);
+
+/**
+ * Free the channel. Nobody can use it anymore, including the
+ * suspended coroutines and blocked threads.
+ */
+void coro_bus_mt_channel_delete(struct coro_bus_mt_channel* ch);
+
+/**
+ * Send the message. If the channel is full, the current coroutine
+ * or the thread is blocked until there is space.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed.
+ */
+int coro_bus_mt_send(struct coro_bus_mt_channel* ch, unsigned data);
+
+/**
+ * Same as coro_bus_mt_send(), but never blocks.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int coro_bus_mt_try_send(struct coro_bus_mt_channel* ch, unsigned data);
+
+/**
+ * Receive a message. If the channel is empty, the current
+ * coroutine or the thread is blocked until there is a message.
+ *
+ * @retval 0 Success. Data output is filled with the received
+ *     message.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed.
+ */
+int coro_bus_mt_recv(struct coro_bus_mt_channel* ch, unsigned* data);
+
+/**
+ * Same as coro_bus_mt_recv(), but never blocks.
+ *
+ * @retval 0 Success. Data output is filled with the received
+ *     message.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int coro_bus_mt_try_recv(struct coro_bus_mt_channel* ch, unsigned* data);
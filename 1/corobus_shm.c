@@ -0,0 +1,364 @@
+#define _GNU_SOURCE /* memfd_create */
+#include "corobus_shm.h"
+
+#include "libcoro.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_LINE_SIZE 64
+
+/** Tells a channel segment from a random file. */
+#define SHM_MAGIC 0x636f7362u
+
+/**
+ * A cell of the ring. Same as in the thread-safe channels: the
+ * sequence number is 2 * pos when the cell is free for the sender
+ * at position pos, and 2 * pos + 1 when it holds data for the
+ * receiver at that position.
+ */
+struct shm_cell
+{
+	_Atomic uint64_t seq;
+	unsigned data;
+};
+
+/**
+ * Waiters of one side of the channel. The count tells the peers
+ * to wake somebody up. The wakeups themselves go through the
+ * eventfd of the side, one token per wakeup.
+ */
+struct shm_wait_queue
+{
+	_Atomic uint32_t count;
+};
+
+/** Start of the segment. Only offsets and atomics, no pointers. */
+struct shm_header
+{
+	uint32_t magic;
+	_Atomic uint32_t is_closed;
+	uint64_t size_limit;
+	struct shm_wait_queue send_queue;
+	struct shm_wait_queue recv_queue;
+
+	char pad_head[CACHE_LINE_SIZE];
+	_Atomic uint64_t head;
+	char pad_tail[CACHE_LINE_SIZE];
+	_Atomic uint64_t tail;
+	char pad_end[CACHE_LINE_SIZE];
+
+	struct shm_cell cells[];
+};
+
+/** Mapping of the segment in this process. */
+struct coro_bus_shm_channel
+{
+	int fd;
+	/** Semaphore eventfds waking up the senders and the receivers. */
+	int send_event_fd;
+	int recv_event_fd;
+	size_t map_size;
+	struct shm_header* hdr;
+};
+
+static size_t shm_segment_size(size_t size_limit)
+{
+	return sizeof(struct shm_header) + size_limit * sizeof(struct shm_cell);
+}
+
+static struct coro_bus_shm_channel* shm_channel_map(int fd, int send_event_fd, int recv_event_fd, size_t map_size)
+{
+	void* addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+	struct coro_bus_shm_channel* ch = (struct coro_bus_shm_channel*) malloc(sizeof(*ch));
+	assert(ch);
+	ch->fd = fd;
+	ch->send_event_fd = send_event_fd;
+	ch->recv_event_fd = recv_event_fd;
+	ch->map_size = map_size;
+	ch->hdr = (struct shm_header*) addr;
+	return ch;
+}
+
+static void shm_close_fds(int fd, int send_event_fd, int recv_event_fd)
+{
+	if (fd >= 0)
+		close(fd);
+	if (send_event_fd >= 0)
+		close(send_event_fd);
+	if (recv_event_fd >= 0)
+		close(recv_event_fd);
+}
+
+struct coro_bus_shm_channel* coro_bus_shm_channel_new(size_t size_limit)
+{
+	assert(size_limit > 0);
+	int fd = memfd_create("corobus", MFD_CLOEXEC);
+	const int event_flags = EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE;
+	int send_event_fd = eventfd(0, event_flags);
+	int recv_event_fd = eventfd(0, event_flags);
+	size_t map_size = shm_segment_size(size_limit);
+	struct coro_bus_shm_channel* ch = NULL;
+	if (fd >= 0 && send_event_fd >= 0 && recv_event_fd >= 0 &&
+		ftruncate(fd, map_size) == 0)
+		ch = shm_channel_map(fd, send_event_fd, recv_event_fd, map_size);
+	if (!ch)
+	{
+		shm_close_fds(fd, send_event_fd, recv_event_fd);
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return NULL;
+	}
+	/* The file is zeroed, only the non-zero fields are set. */
+	struct shm_header* hdr = ch->hdr;
+	hdr->size_limit = size_limit;
+	for (size_t i = 0; i < size_limit; ++i)
+		atomic_init(&hdr->cells[i].seq, 2 * i);
+	atomic_store(&hdr->is_closed, 0);
+	hdr->magic = SHM_MAGIC;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return ch;
+}
+
+struct coro_bus_shm_channel* coro_bus_shm_channel_open(const int fds[CORO_BUS_SHM_FD_COUNT])
+{
+	struct stat st;
+	if (fstat(fds[0], &st) != 0 || (size_t)st.st_size < sizeof(struct shm_header))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	int fd = fcntl(fds[0], F_DUPFD_CLOEXEC, 0);
+	int send_event_fd = fcntl(fds[1], F_DUPFD_CLOEXEC, 0);
+	int recv_event_fd = fcntl(fds[2], F_DUPFD_CLOEXEC, 0);
+	struct coro_bus_shm_channel* ch = NULL;
+	if (fd >= 0 && send_event_fd >= 0 && recv_event_fd >= 0)
+		ch = shm_channel_map(fd, send_event_fd, recv_event_fd, st.st_size);
+	if (!ch)
+	{
+		shm_close_fds(fd, send_event_fd, recv_event_fd);
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return NULL;
+	}
+	if (ch->hdr->magic != SHM_MAGIC ||
+		shm_segment_size(ch->hdr->size_limit) != ch->map_size)
+	{
+		coro_bus_shm_channel_delete(ch);
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return ch;
+}
+
+void coro_bus_shm_channel_fds(const struct coro_bus_shm_channel* ch, int fds[CORO_BUS_SHM_FD_COUNT])
+{
+	assert(ch);
+	fds[0] = ch->fd;
+	fds[1] = ch->send_event_fd;
+	fds[2] = ch->recv_event_fd;
+}
+
+void coro_bus_shm_channel_delete(struct coro_bus_shm_channel* ch)
+{
+	assert(ch);
+	munmap(ch->hdr, ch->map_size);
+	shm_close_fds(ch->fd, ch->send_event_fd, ch->recv_event_fd);
+	free(ch);
+}
+
+static void shm_wakeup_first(struct shm_wait_queue* queue, int event_fd)
+{
+	/* Pairs with the fence in shm_wait_begin(). */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&queue->count, memory_order_relaxed) == 0)
+		return;
+	uint64_t one = 1;
+	/* EAGAIN means the counter is full of tokens already. */
+	ssize_t rc = write(event_fd, &one, sizeof(one));
+	(void)rc;
+}
+
+static void shm_wakeup_all(int event_fd)
+{
+	/* More tokens than there can be waiters, the channel is dead. */
+	uint64_t many = INT_MAX;
+	ssize_t rc = write(event_fd, &many, sizeof(many));
+	(void)rc;
+}
+
+void coro_bus_shm_channel_close(struct coro_bus_shm_channel* ch)
+{
+	assert(ch);
+	atomic_store(&ch->hdr->is_closed, 1);
+	shm_wakeup_all(ch->send_event_fd);
+	shm_wakeup_all(ch->recv_event_fd);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+}
+
+/**
+ * Register the waiter before the last check of the ring. Then the
+ * peer either sees the waiter and leaves a token in the eventfd,
+ * or the waiter sees the peer's change in the ring.
+ */
+static void shm_wait_begin(struct shm_wait_queue* queue)
+{
+	atomic_fetch_add(&queue->count, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+/**
+ * Pause the coroutine until a token comes, and take it. Another
+ * waiter can take the token first, and a token can be left by a
+ * waiter which didn't need it, so the caller checks the ring again
+ * anyway.
+ */
+static void shm_wait(int event_fd)
+{
+	coro_wait_fd(event_fd, POLLIN);
+	uint64_t token;
+	ssize_t rc = read(event_fd, &token, sizeof(token));
+	(void)rc;
+}
+
+static void shm_wait_end(struct shm_wait_queue* queue)
+{
+	atomic_fetch_sub(&queue->count, 1);
+}
+
+static bool shm_push(struct shm_header* hdr, unsigned data)
+{
+	uint64_t pos = atomic_load_explicit(&hdr->tail, memory_order_relaxed);
+	while (true)
+	{
+		struct shm_cell* cell = &hdr->cells[pos % hdr->size_limit];
+		uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		int64_t diff = (int64_t)(seq - 2 * pos);
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&hdr->tail, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed))
+			{
+				cell->data = data;
+				atomic_store_explicit(&cell->seq, 2 * pos + 1, memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = atomic_load_explicit(&hdr->tail, memory_order_relaxed);
+	}
+}
+
+static bool shm_pop(struct shm_header* hdr, unsigned* data)
+{
+	uint64_t pos = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+	while (true)
+	{
+		struct shm_cell* cell = &hdr->cells[pos % hdr->size_limit];
+		uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		int64_t diff = (int64_t)(seq - (2 * pos + 1));
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&hdr->head, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed))
+			{
+				*data = cell->data;
+				atomic_store_explicit(&cell->seq, 2 * (pos + hdr->size_limit), memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+	}
+}
+
+int coro_bus_shm_try_send(struct coro_bus_shm_channel* ch, unsigned data)
+{
+	assert(ch);
+	struct shm_header* hdr = ch->hdr;
+	if (atomic_load_explicit(&hdr->is_closed, memory_order_relaxed))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (!shm_push(hdr, data))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	shm_wakeup_first(&hdr->recv_queue, ch->recv_event_fd);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_shm_try_recv(struct coro_bus_shm_channel* ch, unsigned* data)
+{
+	assert(ch);
+	struct shm_header* hdr = ch->hdr;
+	if (atomic_load_explicit(&hdr->is_closed, memory_order_relaxed))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (!shm_pop(hdr, data))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	shm_wakeup_first(&hdr->send_queue, ch->send_event_fd);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_shm_send(struct coro_bus_shm_channel* ch, unsigned data)
+{
+	while (true)
+	{
+		if (coro_bus_shm_try_send(ch, data) == 0)
+			return 0;
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return -1;
+		struct shm_wait_queue* queue = &ch->hdr->send_queue;
+		shm_wait_begin(queue);
+		int rc = coro_bus_shm_try_send(ch, data);
+		if (rc != 0 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK)
+			shm_wait(ch->send_event_fd);
+		shm_wait_end(queue);
+		if (rc == 0 || coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return rc;
+	}
+}
+
+int coro_bus_shm_recv(struct coro_bus_shm_channel* ch, unsigned* data)
+{
+	while (true)
+	{
+		if (coro_bus_shm_try_recv(ch, data) == 0)
+			return 0;
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return -1;
+		struct shm_wait_queue* queue = &ch->hdr->recv_queue;
+		shm_wait_begin(queue);
+		int rc = coro_bus_shm_try_recv(ch, data);
+		if (rc != 0 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK)
+			shm_wait(ch->recv_event_fd);
+		shm_wait_end(queue);
+		if (rc == 0 || coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return rc;
+	}
+}
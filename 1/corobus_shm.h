@@ -0,0 +1,105 @@
+#pragma once
+
+#include "corobus.h"
+
+/**
+ * Channels shared between processes. A channel lives in a memfd
+ * segment, which can be inherited via fork() or passed over a
+ * unix socket. Messages go through a lock-free ring inside the
+ * segment, so a message costs no syscalls unless somebody waits.
+ *
+ * Each side of the channel has an eventfd shared by the processes.
+ * A blocked call waits on it via coro_wait_fd(), so it pauses only
+ * its coroutine, and the other coroutines of the thread go on.
+ *
+ * Errors are reported via coro_bus_errno().
+ */
+
+struct coro_bus_shm_channel;
+
+/** The segment and the eventfds of both sides. */
+#define CORO_BUS_SHM_FD_COUNT 3
+
+/**
+ * Create a channel in a new shared memory segment.
+ * @param size_limit Maximum messages a channel can hold at once.
+ *     Must be > 0.
+ *
+ * @retval NULL Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_SYSTEM - the segment could not be created or
+ *       mapped.
+ */
+struct coro_bus_shm_channel* coro_bus_shm_channel_new(size_t size_limit);
+
+/**
+ * Attach to the channel created by another process.
+ * @param fds Descriptors of the channel, see
+ *     coro_bus_shm_channel_fds(). The channel takes its own copies
+ *     of them.
+ *
+ * @retval NULL Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the descriptors are not a channel.
+ *     - CORO_BUS_ERR_SYSTEM - the segment could not be mapped.
+ */
+struct coro_bus_shm_channel* coro_bus_shm_channel_open(const int fds[CORO_BUS_SHM_FD_COUNT]);
+
+/**
+ * Descriptors of the channel, to hand them to another process, for
+ * example over a unix socket in one SCM_RIGHTS message.
+ */
+void coro_bus_shm_channel_fds(const struct coro_bus_shm_channel* ch, int fds[CORO_BUS_SHM_FD_COUNT]);
+
+/**
+ * Close the channel for all the processes. All pending messages
+ * are lost. All the waiters are woken up and get the error that
+ * the channel is missing, so are all the later calls.
+ */
+void coro_bus_shm_channel_close(struct coro_bus_shm_channel* ch);
+
+/**
+ * Detach from the channel in this process. The segment is freed
+ * when the last process detaches.
+ */
+void coro_bus_shm_channel_delete(struct coro_bus_shm_channel* ch);
+
+/**
+ * Send the message. If the channel is full, the coroutine is
+ * paused until there is space.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed.
+ */
+int coro_bus_shm_send(struct coro_bus_shm_channel* ch, unsigned data);
+
+/**
+ * Same as coro_bus_shm_send(), but never blocks.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int coro_bus_shm_try_send(struct coro_bus_shm_channel* ch, unsigned data);
+
+/**
+ * Receive a message. If the channel is empty, the coroutine is
+ * paused until there is a message.
+ *
+ * @retval 0 Success. Data output is filled with the received
+ *     message.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed.
+ */
+int coro_bus_shm_recv(struct coro_bus_shm_channel* ch, unsigned* data);
+
+/**
+ * Same as coro_bus_shm_recv(), but never blocks.
+ *
+ * @retval 0 Success. Data output is filled with the received
+ *     message.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int coro_bus_shm_try_recv(struct coro_bus_shm_channel* ch, unsigned* data);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* REG_RIP */
 #include "libcoro.h"
 
 #include "rlist.h"
@@ -6,10 +7,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
@@ -42,6 +50,25 @@ struct coro {
 	struct coro *joiner;
 	/** Links in a coroutine list, used by the scheduler. */
 	struct rlist link;
+	/** Engine owning the coroutine. */
+	struct coro_engine *engine;
+	/** Next coroutine in the remote wakeup inbox of the engine. */
+	struct coro *remote_next;
+	/** The coroutine is already in the remote wakeup inbox. */
+	atomic_bool is_remote_woken;
+	/** When to wake up the coroutine if nobody else does it. */
+	uint64_t deadline;
+	/** Links in the timer list of the engine, ordered by deadline. */
+	struct rlist timer_link;
+	/** The coroutine was woken up by the timer. */
+	bool is_timed_out;
+	/** Descriptor and events the coroutine waits for. */
+	int wait_fd;
+	short wait_events;
+	/** Events happened on the descriptor, 0 if woken up otherwise. */
+	short wait_revents;
+	/** Links in the descriptor waiters list of the engine. */
+	struct rlist fd_link;
 };
 
 struct coro_engine {
@@ -68,6 +95,35 @@ struct coro_engine {
 	struct rlist coros_pool;
 	/** Total number of coroutines, including the pool. */
 	size_t coro_count;
+	/**
+	 * Coroutines woken up by other threads. It is a lock-free
+	 * stack, which the scheduler takes whole on each iteration.
+	 */
+	_Atomic(struct coro *) remote_inbox;
+	/**
+	 * How many coroutines wait for a wakeup from another
+	 * thread. While there are any, the scheduler sleeps instead
+	 * of finishing when nothing is runnable.
+	 */
+	size_t remote_wait_count;
+	/**
+	 * Coroutines suspended with a timeout, the nearest deadline
+	 * first.
+	 */
+	struct rlist timers;
+	/** Coroutines waiting for events on descriptors. */
+	struct rlist fd_waiters;
+	size_t fd_waiter_count;
+	/** Poll set, rebuilt from the waiters on each poll. */
+	struct pollfd *pollfds;
+	size_t pollfd_capacity;
+	/**
+	 * The scheduler sleeps in poll() on the descriptors and on
+	 * the eventfd, which other threads kick when put something
+	 * into the inbox.
+	 */
+	atomic_bool is_sleeping;
+	int wake_fd;
 	/**
 	 * Buffer, used by the coroutine constructor to escape
 	 * from the signal handler back into the constructor to
@@ -84,6 +140,22 @@ coro_engine_create(struct coro_engine *engine)
 	rlist_create(&engine->coros_running_now);
 	rlist_create(&engine->coros_running_next);
 	rlist_create(&engine->coros_pool);
+	rlist_create(&engine->timers);
+	engine->sched.engine = engine;
+	atomic_init(&engine->remote_inbox, NULL);
+	rlist_create(&engine->fd_waiters);
+	atomic_init(&engine->is_sleeping, false);
+	engine->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (engine->wake_fd < 0)
+		handle_error();
+}
+
+static uint64_t
+coro_clock_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 static void
@@ -137,19 +209,222 @@ coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
 		return;
 	assert(coro->state == CORO_STATE_SUSPENDED);
 	assert(rlist_empty(&coro->link));
+	rlist_del(&coro->timer_link);
+	if (!rlist_empty(&coro->fd_link)) {
+		rlist_del(&coro->fd_link);
+		assert(engine->fd_waiter_count > 0);
+		--engine->fd_waiter_count;
+	}
 	coro->state = CORO_STATE_RUNNING;
 	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
 }
 
+static bool
+coro_engine_suspend_timeout(struct coro_engine *engine, uint64_t timeout_ns)
+{
+	struct coro *this = engine->this;
+	assert(rlist_empty(&this->timer_link));
+	uint64_t now = coro_clock_now();
+	/* Clamp, so a huge timeout doesn't wrap into the past. */
+	this->deadline = timeout_ns > UINT64_MAX - now ?
+			 UINT64_MAX : now + timeout_ns;
+	this->is_timed_out = false;
+	/* Usually the new timer is the latest, so search from the end. */
+	struct rlist *pos = engine->timers.prev;
+	while (pos != &engine->timers &&
+	       rlist_entry(pos, struct coro, timer_link)->deadline >
+	       this->deadline)
+		pos = pos->prev;
+	rlist_add(pos, &this->timer_link);
+	coro_engine_suspend(engine);
+	assert(rlist_empty(&this->timer_link));
+	bool rc = this->is_timed_out;
+	this->is_timed_out = false;
+	return rc;
+}
+
+static short
+coro_engine_wait_fd(struct coro_engine *engine, int fd, short events)
+{
+	struct coro *this = engine->this;
+	assert(rlist_empty(&this->fd_link));
+	this->wait_fd = fd;
+	this->wait_events = events;
+	this->wait_revents = 0;
+	rlist_add_tail(&engine->fd_waiters, &this->fd_link);
+	++engine->fd_waiter_count;
+	coro_engine_suspend(engine);
+	assert(rlist_empty(&this->fd_link));
+	return this->wait_revents;
+}
+
+/** Wake up the coroutines whose deadline has come. */
+static void
+coro_engine_fire_timers(struct coro_engine *engine)
+{
+	if (rlist_empty(&engine->timers))
+		return;
+	uint64_t now = coro_clock_now();
+	while (!rlist_empty(&engine->timers)) {
+		struct coro *c = rlist_first_entry(&engine->timers,
+			struct coro, timer_link);
+		if (c->deadline > now)
+			break;
+		c->is_timed_out = true;
+		coro_engine_wakeup(engine, c);
+	}
+}
+
+static void
+coro_engine_suspend_remote(struct coro_engine *engine)
+{
+	++engine->remote_wait_count;
+	coro_engine_suspend(engine);
+	assert(engine->remote_wait_count > 0);
+	--engine->remote_wait_count;
+}
+
+static void
+coro_engine_wakeup_remote(struct coro_engine *engine, struct coro *coro)
+{
+	if (atomic_exchange(&coro->is_remote_woken, true))
+		return;
+	struct coro *head = atomic_load(&engine->remote_inbox);
+	do {
+		coro->remote_next = head;
+	} while (!atomic_compare_exchange_weak(&engine->remote_inbox, &head,
+		coro));
+	/*
+	 * Pairs with the sleeping flag check in the scheduler. Either
+	 * it sees the inbox not empty, or this thread sees it sleeping.
+	 */
+	if (!atomic_load(&engine->is_sleeping))
+		return;
+	uint64_t one = 1;
+	if (write(engine->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		handle_error();
+}
+
+/** Move the coroutines woken up by other threads to the run queue. */
+static void
+coro_engine_drain_remote(struct coro_engine *engine)
+{
+	struct coro *c = atomic_exchange(&engine->remote_inbox, NULL);
+	/* The inbox is a stack. Reverse it to keep the wakeup order. */
+	struct coro *prev = NULL;
+	while (c != NULL) {
+		struct coro *next = c->remote_next;
+		c->remote_next = prev;
+		prev = c;
+		c = next;
+	}
+	for (c = prev; c != NULL; c = prev) {
+		prev = c->remote_next;
+		c->remote_next = NULL;
+		atomic_store(&c->is_remote_woken, false);
+		coro_engine_wakeup(engine, c);
+	}
+}
+
+/**
+ * Wake up the coroutines whose descriptors are ready. When idle,
+ * sleep until that, or until another thread wakes up some
+ * coroutine, or until the nearest timer expires.
+ */
+static void
+coro_engine_poll(struct coro_engine *engine, bool is_idle)
+{
+	size_t count = engine->fd_waiter_count + 1;
+	if (count > engine->pollfd_capacity) {
+		engine->pollfd_capacity = count * 2;
+		engine->pollfds = realloc(engine->pollfds,
+			engine->pollfd_capacity * sizeof(*engine->pollfds));
+	}
+	struct pollfd *fds = engine->pollfds;
+	fds[0].fd = engine->wake_fd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	size_t i = 1;
+	struct coro *c;
+	rlist_foreach_entry(c, &engine->fd_waiters, fd_link) {
+		fds[i].fd = c->wait_fd;
+		fds[i].events = c->wait_events;
+		fds[i].revents = 0;
+		++i;
+	}
+	assert(i == count);
+
+	struct timespec ts = {0, 0};
+	struct timespec *timeout = &ts;
+	if (is_idle) {
+		atomic_store(&engine->is_sleeping, true);
+		/*
+		 * Pairs with the inbox push in the remote wakeup. Either
+		 * the inbox is seen not empty here, or the waker sees the
+		 * scheduler sleeping and kicks the eventfd.
+		 */
+		if (atomic_load(&engine->remote_inbox) != NULL) {
+			/* Don't sleep. */
+		} else if (!rlist_empty(&engine->timers)) {
+			uint64_t deadline = rlist_first_entry(&engine->timers,
+				struct coro, timer_link)->deadline;
+			uint64_t now = coro_clock_now();
+			uint64_t left = deadline > now ? deadline - now : 0;
+			ts.tv_sec = left / 1000000000;
+			ts.tv_nsec = left % 1000000000;
+		} else {
+			timeout = NULL;
+		}
+	}
+	int rc = ppoll(fds, count, timeout, NULL);
+	if (is_idle)
+		atomic_store(&engine->is_sleeping, false);
+	if (rc < 0) {
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	if (fds[0].revents != 0) {
+		uint64_t value;
+		if (read(engine->wake_fd, &value, sizeof(value)) < 0 &&
+		    errno != EAGAIN)
+			handle_error();
+	}
+	/*
+	 * The waiters list is in the same order as the poll set.
+	 * Woken waiters leave the list, so go by the saved next link.
+	 */
+	struct rlist *pos = rlist_first(&engine->fd_waiters);
+	for (i = 1; i < count; ++i) {
+		c = rlist_entry(pos, struct coro, fd_link);
+		pos = pos->next;
+		if (fds[i].revents == 0)
+			continue;
+		c->wait_revents = fds[i].revents;
+		coro_engine_wakeup(engine, c);
+	}
+}
+
 static void
 coro_engine_run(struct coro_engine *engine)
 {
 	while (true) {
 		assert(rlist_empty(&engine->coros_running_now));
+		coro_engine_drain_remote(engine);
+		coro_engine_fire_timers(engine);
+		if (engine->fd_waiter_count > 0 &&
+		    !rlist_empty(&engine->coros_running_next))
+			coro_engine_poll(engine, false);
 		rlist_splice_tail(&engine->coros_running_now,
 			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
+		if (rlist_empty(&engine->coros_running_now)) {
+			if (engine->remote_wait_count == 0 &&
+			    rlist_empty(&engine->timers) &&
+			    engine->fd_waiter_count == 0)
+				break;
+			coro_engine_poll(engine, true);
+			continue;
+		}
 
 		assert(engine->this == NULL);
 		engine->this = &engine->sched;
@@ -183,11 +458,23 @@ coro_engine_destroy(struct coro_engine *engine)
 		--engine->coro_count;
 	}
 	assert(engine->coro_count == 0);
+	assert(atomic_load(&engine->remote_inbox) == NULL);
+	assert(rlist_empty(&engine->timers));
+	assert(engine->fd_waiter_count == 0);
+	free(engine->pollfds);
+	close(engine->wake_fd);
 	memset(engine, '#', sizeof(*engine));
 }
 
 static __thread struct coro_engine *new_coro_engine = NULL;
 
+/**
+ * The signal handler and the alternative stack setup are global
+ * for the process. Coroutines created by several threads at once
+ * have to do it one by one.
+ */
+static pthread_mutex_t spawn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * The core part of the coroutines creation - this signal handler
  * runs on a separate stack using sigaltstack. At invocation it
@@ -195,9 +482,22 @@ static __thread struct coro_engine *new_coro_engine = NULL;
  * constructor. Later the coroutine continues from here.
  */
 static void
-coro_body(int signum)
+coro_body(int signum, siginfo_t *info, void *uctx)
 {
 	(void)signum;
+	(void)info;
+#if defined(__linux__) && defined(__x86_64__)
+	/*
+	 * The interrupted context points at the constructor's stack,
+	 * which is reused right after. Make it the outermost frame so
+	 * stack unwinding (backtrace() in the allocation tracers, for
+	 * example) stops at the coroutine bottom instead of walking
+	 * garbage.
+	 */
+	((ucontext_t *)uctx)->uc_mcontext.gregs[REG_RIP] = 0;
+#else
+	(void)uctx;
+#endif
 	struct coro_engine *my_engine = new_coro_engine;
 	new_coro_engine = NULL;
 
@@ -244,7 +544,18 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	c->func = func;
 	c->func_arg = func_arg;
 	c->joiner = NULL;
+	c->engine = engine;
+	c->remote_next = NULL;
+	atomic_init(&c->is_remote_woken, false);
+	c->deadline = 0;
+	rlist_create(&c->timer_link);
+	c->is_timed_out = false;
+	c->wait_fd = -1;
+	c->wait_events = 0;
+	c->wait_revents = 0;
+	rlist_create(&c->fd_link);
 	rlist_create(&c->link);
+	pthread_mutex_lock(&spawn_mutex);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -260,8 +571,8 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	 * becomes dedicated to that single coroutine.
 	 */
 	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
+	newsa.sa_sigaction = coro_body;
+	newsa.sa_flags = SA_ONSTACK | SA_SIGINFO;
 	sigemptyset(&newsa.sa_mask);
 	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
 		handle_error();
@@ -305,6 +616,7 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+	pthread_mutex_unlock(&spawn_mutex);
 
 	/* Now scheduler can work with that coroutine. */
 	++engine->coro_count;
@@ -349,7 +661,8 @@ coro_engine_join(struct coro_engine *engine, struct coro *coro)
 
 //////////////////////////////////////////////////////////////////
 
-static struct coro_engine glob_engine;
+/** Each thread can run its own engine. */
+static __thread struct coro_engine glob_engine;
 
 void
 coro_sched_init(void)
@@ -404,3 +717,30 @@ coro_wakeup(struct coro *coro)
 {
 	coro_engine_wakeup(&glob_engine, coro);
 }
+
+bool
+coro_suspend_timeout(uint64_t timeout_ns)
+{
+	return coro_engine_suspend_timeout(&glob_engine, timeout_ns);
+}
+
+short
+coro_wait_fd(int fd, short events)
+{
+	return coro_engine_wait_fd(&glob_engine, fd, events);
+}
+
+void
+coro_suspend_remote(void)
+{
+	coro_engine_suspend_remote(&glob_engine);
+}
+
+void
+coro_wakeup_remote(struct coro *coro)
+{
+	if (coro->engine == &glob_engine)
+		coro_engine_wakeup(&glob_engine, coro);
+	else
+		coro_engine_wakeup_remote(coro->engine, coro);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 struct coro;
 typedef void *(*coro_f)(void *);
@@ -54,6 +55,30 @@ coro_join(struct coro *coro);
 void
 coro_suspend(void);
 
+/**
+ * Same as coro_suspend(), but the coroutine is woken up by the
+ * scheduler itself if nobody does it in timeout_ns nanoseconds.
+ * While there are such coroutines, the scheduler sleeps when
+ * nothing is runnable instead of finishing.
+ *
+ * @retval true The timeout has expired.
+ * @retval false Woken up by coro_wakeup().
+ */
+bool
+coro_suspend_timeout(uint64_t timeout_ns);
+
+/**
+ * Pause the current coroutine until the descriptor gets any of
+ * the poll() events. The scheduler polls the descriptors of all
+ * such coroutines together, and sleeps in the poll when nothing
+ * else is runnable.
+ *
+ * @return The events happened, as poll() revents. 0 if woken up
+ *     by coro_wakeup() earlier.
+ */
+short
+coro_wait_fd(int fd, short events);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
@@ -69,3 +94,20 @@ coro_yield(void);
  */
 void
 coro_wakeup(struct coro *coro);
+
+/**
+ * Same as coro_suspend(), but the coroutine expects to be woken
+ * up by another thread via coro_wakeup_remote(). While there are
+ * such coroutines, the scheduler sleeps when nothing is runnable
+ * instead of finishing.
+ */
+void
+coro_suspend_remote(void);
+
+/**
+ * Same as coro_wakeup(), but can be called from any thread, even
+ * from the ones not running a coroutine engine. The coroutine is
+ * continued by its own engine, in its own thread.
+ */
+void
+coro_wakeup_remote(struct coro *coro);
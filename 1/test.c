@@ -2,9 +2,21 @@
 
 #include "unit.h"
 #include "corobus.h"
+#include "corobus_bridge.h"
+#include "corobus_mt.h"
+#include "corobus_shm.h"
 
+#include <arpa/inet.h>
 #include <assert.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -190,8 +202,431 @@ test_channel_reopen(void)
 	unit_test_finish();
 }
 
+static void
+test_channel_huge_limit(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("the limit is not preallocated");
+	const size_t limit = (size_t)1 << 40;
+	const int channel_count = 100;
+	int channels[channel_count];
+	for (int i = 0; i < channel_count; ++i) {
+		channels[i] = coro_bus_channel_open(bus, limit);
+		unit_assert(channels[i] >= 0);
+	}
+
+	unit_msg("bursts keep the order");
+	int c1 = channels[0];
+	unsigned next_send = 0;
+	unsigned next_recv = 0;
+	unsigned data = 0;
+	for (int burst = 0; burst < 10; ++burst) {
+		unsigned send_count = 1000 * (burst % 3 + 1);
+		for (unsigned i = 0; i < send_count; ++i)
+			unit_assert(coro_bus_try_send(bus, c1, next_send++) == 0);
+		unsigned recv_count = send_count - 7;
+		for (unsigned i = 0; i < recv_count; ++i) {
+			unit_assert(coro_bus_try_recv(bus, c1, &data) == 0);
+			unit_assert(data == next_recv++);
+		}
+	}
+	while (next_recv < next_send) {
+		unit_assert(coro_bus_try_recv(bus, c1, &data) == 0);
+		unit_assert(data == next_recv++);
+	}
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("the limit is still respected");
+	int c2 = coro_bus_channel_open(bus, 100);
+	for (unsigned i = 0; i < 100; ++i)
+		unit_assert(coro_bus_try_send(bus, c2, i) == 0);
+	unit_assert(coro_bus_try_send(bus, c2, 100) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_channel_gen(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("no channel");
+	unit_assert(coro_bus_channel_gen(bus, 0) == 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("reused descriptor gets a new generation");
+	int c1 = coro_bus_channel_open(bus, 1);
+	unsigned gen1 = coro_bus_channel_gen(bus, c1);
+	unit_assert(gen1 > 0);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_channel_gen(bus, c1) == 0);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 == c1);
+	unsigned gen2 = coro_bus_channel_gen(bus, c2);
+	unit_assert(gen2 > 0 && gen2 != gen1);
+	coro_bus_channel_close(bus, c2);
+
+	unit_msg("the last closed descriptors are reused first");
+	const int count = 1000;
+	int channels[count];
+	for (int i = 0; i < count; ++i) {
+		channels[i] = coro_bus_channel_open(bus, 1);
+		unit_assert(channels[i] == i);
+	}
+	coro_bus_channel_close(bus, channels[10]);
+	coro_bus_channel_close(bus, channels[500]);
+	unit_assert(coro_bus_channel_open(bus, 1) == 500);
+	unit_assert(coro_bus_channel_open(bus, 1) == 10);
+	unit_assert(coro_bus_channel_open(bus, 1) == count);
+	for (int i = 0; i <= count; ++i)
+		coro_bus_channel_close(bus, i);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
+#if CORO_BUS_STATS
+
+static void
+test_channel_stats(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 2);
+	struct coro_bus_channel_stats stats;
+
+	unit_msg("fresh channel");
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.msg_in == 0 && stats.msg_out == 0);
+	unit_assert(stats.depth == 0 && stats.depth_max == 0);
+
+	unit_msg("counters and depth");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.msg_in == 2 && stats.msg_out == 1);
+	unit_assert(stats.depth == 1 && stats.depth_max == 2);
+	unit_assert(stats.send_block_count == 0);
+	unit_assert(stats.recv_block_count == 0);
+	uint64_t total = 0;
+	for (int i = 0; i < CORO_BUS_LATENCY_BUCKETS; ++i)
+		total += stats.latency_hist[i];
+	unit_assert(total == 1);
+
+	unit_msg("blocked sender");
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	struct ctx_send ctx;
+	send_start(&ctx, bus, c1, 4);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(send_join(&ctx) == 0);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_block_count == 1);
+	unit_assert(stats.recv_block_count == 0);
+
+	unit_msg("blocked receiver");
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	struct ctx_recv ctx2;
+	recv_start(&ctx2, bus, c1, &data);
+	coro_yield();
+	unit_assert(!ctx2.is_done);
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(recv_join(&ctx2) == 0);
+	unit_assert(data == 5);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.recv_block_count == 1);
+	unit_assert(stats.msg_in == 5 && stats.msg_out == 5);
+	unit_assert(stats.depth == 0);
+
+	unit_msg("dump");
+	char buf[1024];
+	FILE *out = fmemopen(buf, sizeof(buf), "w");
+	coro_bus_stats_dump(bus, out);
+	fclose(out);
+	unit_assert(strstr(buf, "in 5 out 5") != NULL);
+
+	unit_msg("no channel");
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+#endif
+
+static uint64_t
+test_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct ctx_recv_timeout {
+	struct coro_bus *bus;
+	int channel;
+	uint64_t timeout_ns;
+	unsigned data;
+	int rc;
+	enum coro_bus_error_code err;
+	/** If not NULL, the id is appended here on wakeup. */
+	int *wake_order;
+	int *wake_count;
+	int id;
+};
+
+static void *
+recv_timeout_f(void *arg)
+{
+	struct ctx_recv_timeout *ctx = arg;
+	ctx->rc = coro_bus_recv_timeout(ctx->bus, ctx->channel, &ctx->data,
+		ctx->timeout_ns);
+	ctx->err = coro_bus_errno();
+	if (ctx->wake_order != NULL)
+		ctx->wake_order[(*ctx->wake_count)++] = ctx->id;
+	return NULL;
+}
+
+static void
+test_channel_timeout(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	const uint64_t ms = 1000000;
+
+	unit_msg("recv from an empty channel times out");
+	unsigned data = 0;
+	uint64_t start = test_now_ns();
+	unit_assert(coro_bus_recv_timeout(bus, c1, &data, 20 * ms) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(test_now_ns() - start >= 20 * ms);
+
+	unit_msg("send to a full channel times out");
+	unit_assert(coro_bus_send_timeout(bus, c1, 1, 20 * ms) == 0);
+	start = test_now_ns();
+	unit_assert(coro_bus_send_timeout(bus, c1, 2, 20 * ms) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(test_now_ns() - start >= 20 * ms);
+	unit_assert(coro_bus_recv_timeout(bus, c1, &data, 0) == 0);
+	unit_assert(data == 1);
+
+	unit_msg("zero timeout doesn't block");
+	unit_assert(coro_bus_recv_timeout(bus, c1, &data, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+
+	unit_msg("a message comes before the timeout");
+	struct ctx_recv_timeout ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.timeout_ns = 10000 * ms;
+	ctx.rc = -1;
+	struct coro *worker = coro_new(recv_timeout_f, &ctx);
+	coro_yield();
+	start = test_now_ns();
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.rc == 0 && ctx.data == 3);
+	unit_assert(test_now_ns() - start < 1000 * ms);
+
+	unit_msg("a huge timeout doesn't wrap around");
+	ctx.timeout_ns = UINT64_MAX;
+	ctx.rc = -1;
+	worker = coro_new(recv_timeout_f, &ctx);
+	coro_yield();
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 4) == 0);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.rc == 0 && ctx.data == 4);
+
+	unit_msg("several timers expire in order");
+	struct ctx_recv_timeout ctxs[3];
+	struct coro *workers[3];
+	int wake_order[3];
+	int wake_count = 0;
+	for (int i = 0; i < 3; ++i) {
+		memset(&ctxs[i], 0, sizeof(ctxs[i]));
+		ctxs[i].bus = bus;
+		ctxs[i].channel = c1;
+		ctxs[i].timeout_ns = (30 - 10 * i) * ms;
+		ctxs[i].wake_order = wake_order;
+		ctxs[i].wake_count = &wake_count;
+		ctxs[i].id = i;
+		workers[i] = coro_new(recv_timeout_f, &ctxs[i]);
+	}
+	for (int i = 0; i < 3; ++i) {
+		unit_assert(coro_join(workers[i]) == NULL);
+		unit_assert(ctxs[i].rc != 0);
+		unit_assert(ctxs[i].err == CORO_BUS_ERR_TIMEOUT);
+	}
+	/* The shortest timeout is the last one started. */
+	unit_assert(wake_count == 3);
+	unit_assert(wake_order[0] == 2);
+	unit_assert(wake_order[1] == 1);
+	unit_assert(wake_order[2] == 0);
+
+	unit_msg("close wakes up a timed waiter");
+	ctx.timeout_ns = 10000 * ms;
+	ctx.rc = 0;
+	worker = coro_new(recv_timeout_f, &ctx);
+	coro_yield();
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.rc != 0 && ctx.err == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_recv_timeout(bus, c1, &data, ms) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_channel_lanes(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_lanes(bus, 2, 3);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_try_send_lane(bus, c1, 3, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("the highest lane goes first");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_send_lane(bus, c1, 1, 10) == 0);
+	unit_assert(coro_bus_send_lane(bus, c1, 2, 20) == 0);
+	unit_assert(coro_bus_send_lane(bus, c1, 2, 21) == 0);
+	unsigned expected[] = {20, 21, 10, 1, 2};
+	unsigned data = 0;
+	for (unsigned i = 0; i < 5; ++i) {
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+		unit_assert(data == expected[i]);
+	}
+
+	unit_msg("each lane has its own capacity");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_send_lane(bus, c1, 2, 20) == 0);
+
+	unit_msg("a blocked bulk sender is woken by its lane only");
+	struct ctx_send ctx;
+	send_start(&ctx, bus, c1, 3);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 20);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(send_join(&ctx) == 0);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+struct ctx_serve {
+	struct coro_bus *bus;
+	int channel;
+	/** Calls answered before the channel was closed. */
+	int count;
+};
+
+static void *
+serve_f(void *arg)
+{
+	struct ctx_serve *ctx = arg;
+	int call;
+	unsigned req;
+	while (coro_bus_recv_call(ctx->bus, ctx->channel, &call, &req) == 0) {
+		/* Let the replies go out of order. */
+		if (req % 2 == 0)
+			coro_yield();
+		unit_fail_if(coro_bus_reply(ctx->bus, call, req * 10) != 0);
+		++ctx->count;
+	}
+	return NULL;
+}
+
+static void
+test_channel_call(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 4);
+	unit_assert(c1 >= 0);
+	struct ctx_serve ctx;
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.count = 0;
+	struct coro *server = coro_new(serve_f, &ctx);
+
+	unit_msg("one call");
+	unsigned resp = 0;
+	unit_assert(coro_bus_call(bus, c1, 7, &resp) == 0);
+	unit_assert(resp == 70);
+
+	unit_msg("pipelined calls, more than the channel holds");
+	int calls[10];
+	for (unsigned i = 0; i < 10; ++i) {
+		calls[i] = coro_bus_call_start(bus, c1, i);
+		unit_assert(calls[i] >= 0);
+	}
+	bool is_ok = true;
+	for (unsigned i = 0; i < 10; ++i) {
+		is_ok = is_ok && coro_bus_call_wait(bus, calls[i], &resp) == 0 &&
+			resp == i * 10;
+	}
+	unit_assert(is_ok);
+	unit_assert(coro_bus_call_wait(bus, calls[0], &resp) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_reply(bus, calls[0], 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("a stale call descriptor doesn't reach a new call");
+	int stale = calls[9];
+	int fresh = coro_bus_call_start(bus, c1, 5);
+	unit_assert(fresh >= 0 && fresh != stale);
+	unit_assert(coro_bus_reply(bus, stale, 1) != 0);
+	unit_assert(coro_bus_call_wait(bus, stale, &resp) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_call_wait(bus, fresh, &resp) == 0);
+	unit_assert(resp == 50);
+
+	unit_msg("close fails the calls nobody took");
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_join(server) == NULL);
+	unit_assert(ctx.count == 12);
+	int c2 = coro_bus_channel_open(bus, 4);
+	unit_assert(c2 >= 0);
+	int call = coro_bus_call_start(bus, c2, 1);
+	unit_assert(call >= 0);
+	coro_bus_channel_close(bus, c2);
+	unit_assert(coro_bus_call_wait(bus, call, &resp) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_call(bus, c2, 1, &resp) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
 static void
 test_multiple_channels(void)
 {
@@ -1015,73 +1450,915 @@ test_broadcast_blocking_drop_channel_during_wait(void)
 #endif
 }
 
-////////////////////////////////////////////////////////////////////////////////
+struct ctx_multicast {
+	struct coro_bus *bus;
+	int group;
+	unsigned data;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+};
+
+static void *
+multicast_f(void *arg)
+{
+	struct ctx_multicast *ctx = arg;
+	ctx->rc = coro_bus_multicast(ctx->bus, ctx->group, ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
 
 static void
-test_send_vector_basic(void)
+test_channel_set_limit(void)
 {
-#if NEED_BATCH
 	unit_test_start();
 	struct coro_bus *bus = coro_bus_new();
-
-	unit_msg("channel never existed");
-	unsigned data3[3] = {1, 2, 3};
-	unit_assert(coro_bus_send_v(bus, 0, data3, 3) < 0);
-	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
-	unit_assert(coro_bus_try_send_v(bus, 0, data3, 3) < 0);
-	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
-
-	unit_msg("channel did exist");
-	coro_bus_channel_close(bus, coro_bus_channel_open(bus, 3));
-	unit_assert(coro_bus_send_v(bus, 0, data3, 3) < 0);
-	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
-	unit_assert(coro_bus_try_send_v(bus, 0, data3, 3) < 0);
-	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
-
-	unit_msg("channel is full");
 	int c1 = coro_bus_channel_open(bus, 2);
 	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_channel_set_limit(bus, c1 + 1, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("grow wakes up the senders");
 	unit_assert(coro_bus_send(bus, c1, 1) == 0);
 	unit_assert(coro_bus_send(bus, c1, 2) == 0);
-	unit_assert(coro_bus_try_send_v(bus, c1, data3, 3) < 0);
+	struct ctx_send ctx1, ctx2;
+	send_start(&ctx1, bus, c1, 3);
+	send_start(&ctx2, bus, c1, 4);
+	coro_yield();
+	unit_assert(!ctx1.is_done && !ctx2.is_done);
+	unit_assert(coro_bus_channel_set_limit(bus, c1, 4) == 0);
+	unit_assert(send_join(&ctx1) == 0);
+	unit_assert(send_join(&ctx2) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 5) != 0);
 	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
-	unsigned data = 123;
+
+	unit_msg("shrink keeps the messages");
+	unit_assert(coro_bus_channel_set_limit(bus, c1, 1) == 0);
+	unsigned data = 0;
 	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
 	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 3);
+	unit_assert(coro_bus_try_send(bus, c1, 5) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 4);
+	unit_assert(coro_bus_try_send(bus, c1, 5) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 6) != 0);
+
+	unit_msg("broadcast sees the new limit");
+	unit_assert(coro_bus_try_broadcast(bus, 7) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	struct ctx_broadcast ctx3;
+	broadcast_start(&ctx3, bus, 7);
+	coro_yield();
+	unit_assert(!ctx3.is_done);
+	unit_assert(coro_bus_channel_set_limit(bus, c1, 2) == 0);
+	unit_assert(broadcast_join(&ctx3) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 5);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 7);
+
 	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
 
-	unit_msg("channel is partially full");
-	c1 = coro_bus_channel_open(bus, 5);
+static void
+test_channel_spill(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_lanes(bus, 2, 2);
 	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_channel_spill(bus, c1, "/no/such/dir") != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_SYSTEM);
+
+	unit_msg("a full channel stops blocking");
+	unit_assert(coro_bus_send(bus, c1, 0) == 0);
 	unit_assert(coro_bus_send(bus, c1, 1) == 0);
-	unit_assert(coro_bus_send(bus, c1, 2) == 0);
-	unit_assert(coro_bus_send(bus, c1, 3) == 0);
-	data3[0] = 4, data3[1] = 5, data3[2] = 6;
-	unit_assert(coro_bus_send_v(bus, c1, data3, 3) == 2);
-	for (unsigned i = 1; i <= 5; ++i)
-		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+	struct ctx_send ctx;
+	send_start(&ctx, bus, c1, 2);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_channel_spill(bus, c1, "/tmp") == 0);
+	unit_assert(send_join(&ctx) == 0);
+
+	unit_msg("overflow goes to the file in order");
+	const unsigned count = 20000;
+	bool is_ok = true;
+	for (unsigned i = 3; i < count; ++i)
+		is_ok = is_ok && coro_bus_try_send(bus, c1, i) == 0;
+	unit_assert(is_ok);
+	unit_assert(coro_bus_try_broadcast(bus, count) == 0);
+	unit_assert(coro_bus_send_lane(bus, c1, 1, 100) == 0);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 100);
+	/* Interleave, so the file is both read and appended. */
+	unsigned next_send = count + 1;
+	for (unsigned i = 0; i < count + 1; ++i) {
+		is_ok = is_ok && coro_bus_recv(bus, c1, &data) == 0 && data == i;
+		if (i % 3 == 0)
+			is_ok = is_ok && coro_bus_send(bus, c1, next_send++) == 0;
+	}
+	unit_assert(is_ok);
+	for (unsigned i = count + 1; i < next_send; ++i)
+		is_ok = is_ok && coro_bus_recv(bus, c1, &data) == 0 && data == i;
+	unit_assert(is_ok);
 	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
 	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
-	coro_bus_channel_close(bus, c1);
 
-	unit_msg("same with try-send-v");
-	c1 = coro_bus_channel_open(bus, 5);
-	unit_assert(c1 >= 0);
+	unit_msg("zero limit keeps everything in the file");
+	unit_assert(coro_bus_channel_set_limit(bus, c1, 0) == 0);
 	unit_assert(coro_bus_send(bus, c1, 1) == 0);
 	unit_assert(coro_bus_send(bus, c1, 2) == 0);
-	unit_assert(coro_bus_send(bus, c1, 3) == 0);
-	data3[0] = 4, data3[1] = 5, data3[2] = 6;
-	unit_assert(coro_bus_try_send_v(bus, c1, data3, 3) == 2);
-	for (unsigned i = 1; i <= 5; ++i)
-		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
-	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
-	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
-	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_channel_set_limit(bus, c1, 5) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
 
-	unit_msg("normal full send");
-	c1 = coro_bus_channel_open(bus, 10);
-	unit_assert(c1 >= 0);
-	data3[0] = 1, data3[1] = 2, data3[2] = 3;
+	unit_msg("close with messages in the file");
+	for (unsigned i = 0; i < 10; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	coro_bus_channel_close(bus, c1);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(coro_bus_channel_spill(bus, c2, "/tmp") == 0);
+	unit_assert(coro_bus_send(bus, c2, 1) == 0);
+	unit_assert(coro_bus_send(bus, c2, 2) == 0);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_channel_spill_full(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_channel_spill(bus, c1, "/tmp") == 0);
+	/* The file can't grow past the first resize. */
+	struct rlimit old_limit;
+	unit_assert(getrlimit(RLIMIT_FSIZE, &old_limit) == 0);
+	struct rlimit limit = old_limit;
+	limit.rlim_cur = 100 * 1024;
+	unit_assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+	void (*old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+
+	unit_msg("a file that can't grow makes the channel full");
+	unsigned sent = 0;
+	while (sent < 1000000 && coro_bus_try_send(bus, c1, sent) == 0)
+		++sent;
+	unit_assert(sent > 1 && sent < 1000000);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	struct ctx_send ctx;
+	send_start(&ctx, bus, c1, sent);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+
+	unit_msg("a recv lets the sender in");
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 0);
+	unit_assert(send_join(&ctx) == 0);
+	++sent;
+	unit_assert(coro_bus_try_send(bus, c1, sent) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("nothing is lost");
+	bool is_ok = true;
+	for (unsigned i = 1; i < sent; ++i)
+		is_ok = is_ok && coro_bus_recv(bus, c1, &data) == 0 && data == i;
+	unit_assert(is_ok);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_try_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+
+	signal(SIGXFSZ, old_handler);
+	unit_assert(setrlimit(RLIMIT_FSIZE, &old_limit) == 0);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_multicast(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int g = coro_bus_group_open(bus);
+	unit_assert(g >= 0);
+	unsigned data = 0;
+	unit_assert(coro_bus_try_multicast(bus, g, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("only the members get the message");
+	const int count = 200;
+	int channels[count];
+	for (int i = 0; i < count; ++i)
+		channels[i] = coro_bus_channel_open(bus, 2);
+	for (int i = 0; i < count; i += 3)
+		unit_assert(coro_bus_group_add(bus, g, channels[i]) == 0);
+	unit_assert(coro_bus_group_add(bus, g, channels[0]) == 0);
+	unit_assert(coro_bus_group_add(bus, g, count + 10) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_multicast(bus, g, 7) == 0);
+	for (int i = 0; i < count; ++i) {
+		if (i % 3 == 0) {
+			unit_assert(coro_bus_try_recv(bus, channels[i], &data) == 0);
+			unit_assert(data == 7);
+		} else {
+			unit_assert(coro_bus_try_recv(bus, channels[i], &data) != 0);
+		}
+	}
+
+	unit_msg("a full member blocks the multicast");
+	unit_assert(coro_bus_send(bus, channels[3], 1) == 0);
+	unit_assert(coro_bus_send(bus, channels[3], 2) == 0);
+	unit_assert(coro_bus_try_multicast(bus, g, 8) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_msg("but not a full non-member");
+	unit_assert(coro_bus_send(bus, channels[1], 1) == 0);
+	unit_assert(coro_bus_send(bus, channels[1], 2) == 0);
+	unit_assert(coro_bus_group_remove(bus, g, channels[3]) == 0);
+	unit_assert(coro_bus_try_multicast(bus, g, 8) == 0);
+	unit_assert(coro_bus_group_add(bus, g, channels[3]) == 0);
+
+	unit_msg("the blocked multicast goes when the member has space");
+	struct ctx_multicast ctx;
+	ctx.bus = bus;
+	ctx.group = g;
+	ctx.data = 9;
+	ctx.is_done = false;
+	struct coro *worker = coro_new(multicast_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_recv(bus, channels[3], &data) == 0);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.rc == 0);
+	unit_assert(coro_bus_recv(bus, channels[0], &data) == 0 && data == 8);
+	unit_assert(coro_bus_recv(bus, channels[0], &data) == 0 && data == 9);
+
+	unit_msg("close of the group fails the waiters");
+	ctx.is_done = false;
+	worker = coro_new(multicast_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_bus_group_close(bus, g);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.rc != 0 && ctx.err == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("closed members leave the group");
+	g = coro_bus_group_open(bus);
+	unit_assert(coro_bus_group_add(bus, g, channels[1]) == 0);
+	coro_bus_channel_close(bus, channels[1]);
+	unit_assert(coro_bus_try_multicast(bus, g, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_broadcast_blocking_many(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(coro_bus_send(bus, c1, 0) == 0);
+	unit_assert(coro_bus_send(bus, c2, 0) == 0);
+
+	unit_msg("two broadcasters wait");
+	struct ctx_broadcast ctx1, ctx2;
+	broadcast_start(&ctx1, bus, 1);
+	broadcast_start(&ctx2, bus, 2);
+	coro_yield();
+	unit_assert(ctx1.is_started && !ctx1.is_done);
+	unit_assert(ctx2.is_started && !ctx2.is_done);
+
+	unit_msg("space in one channel is not enough");
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	coro_yield();
+	unit_assert(!ctx1.is_done && !ctx2.is_done);
+
+	unit_msg("space in all channels lets one broadcaster go");
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0);
+	coro_yield();
+	coro_yield();
+	unit_assert(ctx1.is_done && !ctx2.is_done);
+	unit_assert(broadcast_join(&ctx1) == 0);
+
+	unit_msg("closing the last channel fails the rest");
+	coro_bus_channel_close(bus, c1);
+	unit_assert(!ctx2.is_done);
+	coro_bus_channel_close(bus, c2);
+	unit_assert(broadcast_join(&ctx2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_publish {
+	struct coro_bus *bus;
+	int topic;
+	unsigned data;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_started;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+publish_f(void *arg)
+{
+	struct ctx_publish *ctx = arg;
+	ctx->is_started = true;
+	ctx->rc = coro_bus_publish(ctx->bus, ctx->topic, ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+publish_start(struct ctx_publish *ctx, struct coro_bus *bus, int topic,
+	unsigned data)
+{
+	ctx->bus = bus;
+	ctx->topic = topic;
+	ctx->data = data;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_started = false;
+	ctx->is_done = false;
+	ctx->worker = coro_new(publish_f, ctx);
+}
+
+static int
+publish_join(struct ctx_publish *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	unit_assert(ctx->is_done);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+
+static void *
+consume_f(void *arg)
+{
+	struct ctx_recv *ctx = arg;
+	ctx->is_started = true;
+	ctx->rc = coro_bus_consume(ctx->bus, ctx->channel, ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+consume_start(struct ctx_recv *ctx, struct coro_bus *bus, int subscriber,
+	unsigned *data)
+{
+	ctx->bus = bus;
+	ctx->channel = subscriber;
+	ctx->data = data;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_started = false;
+	ctx->is_done = false;
+	ctx->worker = coro_new(consume_f, ctx);
+}
+
+static void
+test_topic_basic(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unsigned data = 0;
+
+	unit_msg("no topic");
+	unit_assert(coro_bus_subscribe(bus, 0) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_publish(bus, 0, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("no subscribers");
+	int t = coro_bus_topic_open(bus, 2);
+	unit_assert(t >= 0);
+	unit_assert(coro_bus_publish(bus, t, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("each subscriber sees every message");
+	int s1 = coro_bus_subscribe(bus, t);
+	unit_assert(s1 >= 0);
+	int s2 = coro_bus_subscribe(bus, t);
+	unit_assert(s2 >= 0 && s2 != s1);
+	unit_assert(coro_bus_try_consume(bus, s1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_publish(bus, t, 10) == 0);
+	unit_assert(coro_bus_publish(bus, t, 20) == 0);
+	unit_assert(coro_bus_try_publish(bus, t, 30) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_consume(bus, s1, &data) == 0 && data == 10);
+	unit_assert(coro_bus_consume(bus, s1, &data) == 0 && data == 20);
+
+	unit_msg("the slowest subscriber holds the publishers");
+	unit_assert(coro_bus_try_publish(bus, t, 30) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_consume(bus, s2, &data) == 0 && data == 10);
+	unit_assert(coro_bus_try_publish(bus, t, 30) == 0);
+
+	unit_msg("a new subscriber starts from the end");
+	int s3 = coro_bus_subscribe(bus, t);
+	unit_assert(s3 >= 0);
+	unit_assert(coro_bus_try_consume(bus, s3, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("unsubscribe of the slowest one frees the ring");
+	coro_bus_unsubscribe(bus, s2);
+	unit_assert(coro_bus_try_consume(bus, s2, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_publish(bus, t, 40) == 0);
+	unit_assert(coro_bus_consume(bus, s1, &data) == 0 && data == 30);
+	unit_assert(coro_bus_consume(bus, s1, &data) == 0 && data == 40);
+	unit_assert(coro_bus_consume(bus, s3, &data) == 0 && data == 40);
+
+	coro_bus_topic_close(bus, t);
+	unit_assert(coro_bus_try_consume(bus, s1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_topic_blocking(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unsigned data = 0;
+	int t = coro_bus_topic_open(bus, 1);
+	unit_assert(t >= 0);
+	int s1 = coro_bus_subscribe(bus, t);
+	int s2 = coro_bus_subscribe(bus, t);
+	unit_assert(s1 >= 0 && s2 >= 0);
+
+	unit_msg("publish wakes up all the consumers");
+	const unsigned consumer_count = 10;
+	struct ctx_recv recv_ctx[consumer_count];
+	unsigned results[consumer_count];
+	int subs[consumer_count];
+	for (unsigned i = 0; i < consumer_count; ++i) {
+		subs[i] = coro_bus_subscribe(bus, t);
+		unit_assert(subs[i] >= 0);
+		consume_start(&recv_ctx[i], bus, subs[i], &results[i]);
+	}
+	coro_yield();
+	for (unsigned i = 0; i < consumer_count; ++i)
+		unit_assert(recv_ctx[i].is_started && !recv_ctx[i].is_done);
+	unit_assert(coro_bus_publish(bus, t, 123) == 0);
+	for (unsigned i = 0; i < consumer_count; ++i) {
+		unit_assert(recv_join(&recv_ctx[i]) == 0 && results[i] == 123);
+		coro_bus_unsubscribe(bus, subs[i]);
+	}
+	unit_assert(coro_bus_consume(bus, s1, &data) == 0 && data == 123);
+	unit_assert(coro_bus_consume(bus, s2, &data) == 0 && data == 123);
+
+	unit_msg("publisher waits for the slowest subscriber");
+	unit_assert(coro_bus_publish(bus, t, 1) == 0);
+	struct ctx_publish ctx;
+	publish_start(&ctx, bus, t, 2);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	unit_assert(coro_bus_consume(bus, s1, &data) == 0 && data == 1);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_consume(bus, s2, &data) == 0 && data == 1);
+	unit_assert(publish_join(&ctx) == 0);
+	unit_assert(coro_bus_consume(bus, s1, &data) == 0 && data == 2);
+	unit_assert(coro_bus_consume(bus, s2, &data) == 0 && data == 2);
+
+	unit_msg("close wakes up the publishers");
+	unit_assert(coro_bus_publish(bus, t, 3) == 0);
+	publish_start(&ctx, bus, t, 4);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	coro_bus_topic_close(bus, t);
+	unit_assert(publish_join(&ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_mt_send {
+	struct coro_bus_mt_channel *ch;
+	unsigned first;
+	unsigned count;
+	pthread_t thread;
+};
+
+static void *
+mt_send_thread_f(void *arg)
+{
+	struct ctx_mt_send *ctx = arg;
+	for (unsigned i = 0; i < ctx->count; ++i)
+		unit_assert(coro_bus_mt_send(ctx->ch, ctx->first + i) == 0);
+	return NULL;
+}
+
+struct ctx_mt_recv {
+	struct coro_bus_mt_channel *ch;
+	bool *results;
+	unsigned count;
+	unsigned last;
+	bool is_ordered;
+	struct coro *worker;
+};
+
+static void *
+mt_recv_f(void *arg)
+{
+	struct ctx_mt_recv *ctx = arg;
+	for (unsigned i = 0; i < ctx->count; ++i) {
+		unsigned data;
+		unit_assert(coro_bus_mt_recv(ctx->ch, &data) == 0);
+		unit_assert(!ctx->results[data]);
+		ctx->results[data] = true;
+		if (i > 0 && data <= ctx->last)
+			ctx->is_ordered = false;
+		ctx->last = data;
+	}
+	return NULL;
+}
+
+static void
+test_mt_channel(enum coro_bus_mt_type type, unsigned sender_count,
+	unsigned receiver_count)
+{
+	unit_test_start();
+	unit_msg("senders %u, receivers %u", sender_count, receiver_count);
+	struct coro_bus_mt_channel *ch = coro_bus_mt_channel_new(4, type);
+	const unsigned data_per_sender = 20000;
+	const unsigned data_count = data_per_sender * sender_count;
+	bool *results = calloc(data_count, sizeof(*results));
+
+	struct ctx_mt_recv recv_ctx[receiver_count];
+	for (unsigned i = 0; i < receiver_count; ++i) {
+		recv_ctx[i].ch = ch;
+		recv_ctx[i].results = results;
+		recv_ctx[i].count = data_count / receiver_count;
+		recv_ctx[i].is_ordered = true;
+		recv_ctx[i].worker = coro_new(mt_recv_f, &recv_ctx[i]);
+	}
+	struct ctx_mt_send send_ctx[sender_count];
+	for (unsigned i = 0; i < sender_count; ++i) {
+		send_ctx[i].ch = ch;
+		send_ctx[i].first = i * data_per_sender;
+		send_ctx[i].count = data_per_sender;
+		unit_assert(pthread_create(&send_ctx[i].thread, NULL,
+			mt_send_thread_f, &send_ctx[i]) == 0);
+	}
+	for (unsigned i = 0; i < receiver_count; ++i)
+		unit_assert(coro_join(recv_ctx[i].worker) == NULL);
+	for (unsigned i = 0; i < sender_count; ++i)
+		unit_assert(pthread_join(send_ctx[i].thread, NULL) == 0);
+
+	unit_msg("nothing is lost");
+	for (unsigned i = 0; i < data_count; ++i)
+		unit_assert(results[i]);
+	if (sender_count == 1 && receiver_count == 1)
+		unit_assert(recv_ctx[0].is_ordered);
+	unsigned data;
+	unit_assert(coro_bus_mt_try_recv(ch, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	free(results);
+	coro_bus_mt_channel_close(ch);
+	coro_bus_mt_channel_delete(ch);
+	unit_test_finish();
+}
+
+static void *
+mt_close_thread_f(void *arg)
+{
+	coro_bus_mt_channel_close(arg);
+	return NULL;
+}
+
+static void
+test_mt_channel_close(void)
+{
+	unit_test_start();
+	struct coro_bus_mt_channel *ch =
+		coro_bus_mt_channel_new(1, CORO_BUS_MT_MPMC);
+	unsigned data = 0;
+	unit_assert(coro_bus_mt_try_recv(ch, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_mt_try_send(ch, 1) == 0);
+	unit_assert(coro_bus_mt_try_send(ch, 2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_mt_recv(ch, &data) == 0 && data == 1);
+
+	unit_msg("a receiver is woken up by close in another thread");
+	pthread_t thread;
+	unit_assert(pthread_create(&thread, NULL, mt_close_thread_f, ch) == 0);
+	unit_assert(coro_bus_mt_recv(ch, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(pthread_join(thread, NULL) == 0);
+	unit_assert(coro_bus_mt_try_send(ch, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_mt_channel_delete(ch);
+	unit_test_finish();
+}
+
+struct ctx_shm_recv {
+	struct coro_bus_shm_channel *ch;
+	unsigned data;
+	int rc;
+};
+
+static void *
+shm_recv_f(void *arg)
+{
+	struct ctx_shm_recv *ctx = arg;
+	ctx->rc = coro_bus_shm_recv(ctx->ch, &ctx->data);
+	return NULL;
+}
+
+static void
+test_shm_channel(void)
+{
+	unit_test_start();
+	struct coro_bus_shm_channel *ch = coro_bus_shm_channel_new(4);
+	unit_assert(ch != NULL);
+	unsigned data = 0;
+	unit_assert(coro_bus_shm_try_recv(ch, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("a blocked recv pauses only its coroutine");
+	struct ctx_shm_recv ctx = {ch, 0, -1};
+	struct coro *worker = coro_new(shm_recv_f, &ctx);
+	coro_yield();
+	coro_yield();
+	unit_assert(ctx.rc == -1);
+	unit_assert(coro_bus_shm_send(ch, 7) == 0);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.rc == 0 && ctx.data == 7);
+
+	unit_msg("another process sends through a full channel");
+	const unsigned count = 100000;
+	pid_t pid = fork();
+	unit_assert(pid >= 0);
+	int fds[CORO_BUS_SHM_FD_COUNT];
+	coro_bus_shm_channel_fds(ch, fds);
+	if (pid == 0) {
+		struct coro_bus_shm_channel *peer =
+			coro_bus_shm_channel_open(fds);
+		if (peer == NULL)
+			_exit(1);
+		for (unsigned i = 0; i < count; ++i) {
+			if (coro_bus_shm_send(peer, i) != 0)
+				_exit(2);
+		}
+		/* Fill the channel and wait for the receiver to close it. */
+		while (coro_bus_shm_send(peer, count) == 0)
+			;
+		_exit(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL ? 0 : 3);
+	}
+	for (unsigned i = 0; i < count; ++i) {
+		unit_assert(coro_bus_shm_recv(ch, &data) == 0);
+		unit_assert(data == i);
+	}
+
+	unit_msg("close wakes up the other process");
+	coro_bus_shm_channel_close(ch);
+	int status = 0;
+	unit_assert(waitpid(pid, &status, 0) == pid);
+	unit_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	unit_assert(coro_bus_shm_try_send(ch, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("not a channel segment");
+	int pipe_fds[2];
+	unit_assert(pipe(pipe_fds) == 0);
+	int bad_fds[CORO_BUS_SHM_FD_COUNT] = {pipe_fds[0], fds[1], fds[2]};
+	unit_assert(coro_bus_shm_channel_open(bad_fds) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+
+	coro_bus_shm_channel_delete(ch);
+	unit_test_finish();
+}
+
+/** A connected pair of loopback TCP sockets with small buffers. */
+static void
+tcp_pair(int *a, int *b)
+{
+	int size = 64 * 1024;
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	unit_assert(listener >= 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	unit_assert(bind(listener, (struct sockaddr *)&addr,
+		sizeof(addr)) == 0);
+	unit_assert(listen(listener, 1) == 0);
+	socklen_t len = sizeof(addr);
+	unit_assert(getsockname(listener, (struct sockaddr *)&addr,
+		&len) == 0);
+	*a = socket(AF_INET, SOCK_STREAM, 0);
+	unit_assert(*a >= 0);
+	setsockopt(*a, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(*a, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	unit_assert(connect(*a, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	*b = accept(listener, NULL, NULL);
+	unit_assert(*b >= 0);
+	setsockopt(*b, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(*b, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	close(listener);
+}
+
+struct ctx_send_many {
+	struct coro_bus *bus;
+	int channel;
+	unsigned count;
+	bool is_done;
+};
+
+static void *
+send_many_f(void *arg)
+{
+	struct ctx_send_many *ctx = arg;
+	for (unsigned i = 0; i < ctx->count; ++i)
+		unit_assert(coro_bus_send(ctx->bus, ctx->channel, i) == 0);
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_bridge(void)
+{
+	unit_test_start();
+	int fd1, fd2;
+	tcp_pair(&fd1, &fd2);
+	struct coro_bus *bus1 = coro_bus_new();
+	struct coro_bus *bus2 = coro_bus_new();
+	struct coro_bus_bridge *bridge1 = coro_bus_bridge_new(bus1, fd1);
+	struct coro_bus_bridge *bridge2 = coro_bus_bridge_new(bus2, fd2);
+	int out = coro_bus_channel_open(bus1, 4);
+	int in = coro_bus_channel_open(bus2, 4);
+	unit_assert(coro_bus_bridge_route(bridge1, out, in) == 0);
+	unit_assert(coro_bus_bridge_route(bridge1, out + 100, in) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("messages go through in order");
+	unsigned data = 0;
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_send(bus1, out, i) == 0);
+	for (unsigned i = 0; i < 3; ++i) {
+		unit_assert(coro_bus_recv(bus2, in, &data) == 0);
+		unit_assert(data == i);
+	}
+
+	unit_msg("a full remote channel blocks the sender");
+	struct ctx_send_many ctx;
+	ctx.bus = bus1;
+	ctx.channel = out;
+	ctx.count = 1000000;
+	ctx.is_done = false;
+	struct coro *worker = coro_new(send_many_f, &ctx);
+	int dummy = coro_bus_channel_open(bus1, 1);
+	unit_assert(coro_bus_recv_timeout(bus1, dummy, &data, 50000000) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(!ctx.is_done);
+	for (unsigned i = 0; i < ctx.count; ++i) {
+		unit_assert(coro_bus_recv(bus2, in, &data) == 0);
+		unit_assert(data == i);
+	}
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.is_done);
+
+#if NEED_BROADCAST
+	unit_msg("broadcast goes through");
+	unit_assert(coro_bus_broadcast(bus1, 7) == 0);
+	unit_assert(coro_bus_recv(bus1, dummy, &data) == 0);
+	unit_assert(coro_bus_recv(bus2, in, &data) == 0);
+	unit_assert(data == 7);
+#endif
+
+	coro_bus_channel_close(bus1, out);
+	coro_bus_bridge_delete(bridge1);
+	coro_bus_bridge_delete(bridge2);
+	coro_bus_delete(bus1);
+	coro_bus_delete(bus2);
+	close(fd1);
+	close(fd2);
+	unit_test_finish();
+}
+
+static void
+test_bridge_disconnect(void)
+{
+	unit_test_start();
+	int fd1, fd2;
+	tcp_pair(&fd1, &fd2);
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_bridge *bridge = coro_bus_bridge_new(bus, fd1);
+	int out = coro_bus_channel_open(bus, 4);
+	unit_assert(coro_bus_bridge_route(bridge, out, 0) == 0);
+
+	unit_msg("the peer is gone, the senders go on");
+	close(fd2);
+	struct ctx_send_many ctx;
+	ctx.bus = bus;
+	ctx.channel = out;
+	ctx.count = 100000;
+	ctx.is_done = false;
+	struct coro *worker = coro_new(send_many_f, &ctx);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.is_done);
+
+	coro_bus_channel_close(bus, out);
+	coro_bus_bridge_delete(bridge);
+	coro_bus_delete(bus);
+	close(fd1);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_send_vector_basic(void)
+{
+#if NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("channel never existed");
+	unsigned data3[3] = {1, 2, 3};
+	unit_assert(coro_bus_send_v(bus, 0, data3, 3) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_send_v(bus, 0, data3, 3) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("channel did exist");
+	coro_bus_channel_close(bus, coro_bus_channel_open(bus, 3));
+	unit_assert(coro_bus_send_v(bus, 0, data3, 3) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_send_v(bus, 0, data3, 3) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("channel is full");
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_try_send_v(bus, c1, data3, 3) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned data = 123;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("channel is partially full");
+	c1 = coro_bus_channel_open(bus, 5);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	data3[0] = 4, data3[1] = 5, data3[2] = 6;
+	unit_assert(coro_bus_send_v(bus, c1, data3, 3) == 2);
+	for (unsigned i = 1; i <= 5; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("same with try-send-v");
+	c1 = coro_bus_channel_open(bus, 5);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	data3[0] = 4, data3[1] = 5, data3[2] = 6;
+	unit_assert(coro_bus_try_send_v(bus, c1, data3, 3) == 2);
+	for (unsigned i = 1; i <= 5; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("normal full send");
+	c1 = coro_bus_channel_open(bus, 10);
+	unit_assert(c1 >= 0);
+	data3[0] = 1, data3[1] = 2, data3[2] = 3;
 	unit_assert(coro_bus_send_v(bus, c1, data3, 3) == 3);
 	unsigned data4[4] = {4, 5, 6, 7};
 	unit_assert(coro_bus_try_send_v(bus, c1, data4, 4) == 4);
@@ -1610,6 +2887,14 @@ coro_main_f(void *arg)
 	(void)arg;
 	test_basic();
 	test_channel_reopen();
+	test_channel_gen();
+	test_channel_huge_limit();
+#if CORO_BUS_STATS
+	test_channel_stats();
+#endif
+	test_channel_timeout();
+	test_channel_lanes();
+	test_channel_call();
 	test_multiple_channels();
 
 	test_send_basic();
@@ -1628,6 +2913,22 @@ coro_main_f(void *arg)
 	test_broadcast_basic();
 	test_broadcast_blocking_basic();
 	test_broadcast_blocking_drop_channel_during_wait();
+	test_broadcast_blocking_many();
+	test_channel_set_limit();
+	test_channel_spill();
+	test_channel_spill_full();
+	test_multicast();
+
+	test_topic_basic();
+	test_topic_blocking();
+
+	test_mt_channel(CORO_BUS_MT_SPSC, 1, 1);
+	test_mt_channel(CORO_BUS_MT_MPMC, 4, 1);
+	test_mt_channel(CORO_BUS_MT_MPMC, 4, 4);
+	test_mt_channel_close();
+	test_shm_channel();
+	test_bridge();
+	test_bridge_disconnect();
 
 	test_send_vector_basic();
 	test_send_vector_blocking();
@@ -2,15 +2,13 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
-struct parser 
-{
-	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
-};
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 enum token_type 
 {
@@ -33,15 +31,68 @@ struct token
 	uint32_t capacity;
 };
 
-static char* token_strdup(const struct token* t)
+/** Where the tokenizer stopped inside a token. */
+enum token_state
 {
-	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
-	res[t->size] = 0;
-	return res;
-}
+	/** Skipping the spaces before a token. */
+	TOKEN_STATE_START,
+	/** Inside a word, maybe in quotes. */
+	TOKEN_STATE_WORD,
+	/** After a backslash in a word. */
+	TOKEN_STATE_ESCAPE,
+	/** After one of &|>, which can be doubled. */
+	TOKEN_STATE_OPERATOR,
+	/** Skipping a comment till the end of the line. */
+	TOKEN_STATE_COMMENT,
+};
+
+/** Where the parser stopped inside a command line. */
+enum line_state
+{
+	/** Commands and the operators between them. */
+	LINE_STATE_COMMANDS,
+	/** After > or >>, the file name goes next. */
+	LINE_STATE_OUT_FILE,
+	/** After the output file, only & or the line end. */
+	LINE_STATE_AFTER_OUT,
+	/** After &, only the line end. */
+	LINE_STATE_AFTER_BACKGROUND,
+	/** The line is bad, skipping the rest of it. */
+	LINE_STATE_SKIP,
+};
+
+/**
+ * The parser keeps everything it got out of the input so far: the
+ * token being read and the line being built. Then each byte is
+ * scanned once, however small the fed pieces are.
+ */
+struct parser 
+{
+	/** Own copy of the fed input. */
+	char *buffer;
+	uint32_t capacity;
+	/** The input being scanned: the own buffer or a fed view. */
+	const char *input;
+	uint32_t size;
+	/**
+	 * Bytes of the input scanned already. They are not needed
+	 * anymore, and are dropped only when the space is needed.
+	 */
+	uint32_t pos;
+
+	enum token_state token_state;
+	/** The open quote in the current word, or 0. */
+	char quote;
+	/** The operator character in TOKEN_STATE_OPERATOR. */
+	char op;
+	struct token token;
+
+	enum line_state line_state;
+	/** The line being built, or NULL. */
+	struct command_line *line;
+	/** Error to report at the end of a skipped line. */
+	enum parser_error error;
+};
 
 static void token_append(struct token *t, char c)
 {
@@ -54,17 +105,119 @@ static void token_append(struct token *t, char c)
 	t->data[t->size++] = c;
 }
 
+static void token_append_n(struct token *t, const char *str, uint32_t len)
+{
+	if (t->capacity - t->size < len) {
+		t->capacity = (t->capacity + 1) * 2;
+		if (t->capacity - t->size < len)
+			t->capacity = t->size + len;
+		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
+	}
+	memcpy(t->data + t->size, str, len);
+	t->size += len;
+}
+
 static void token_reset(struct token *t)
 {
 	t->size = 0;
 	t->type = TOKEN_TYPE_NONE;
 }
 
-static void command_append_arg(struct command *cmd, char *arg)
+/**
+ * A piece of the memory of a command line. Everything in the line
+ * is bump-allocated from its chunks, and freed with them at once.
+ */
+struct arena_chunk
+{
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+enum
+{
+	ARENA_CHUNK_MIN_SIZE = 4096,
+	ARENA_CHUNK_MAX_SIZE = 1024 * 1024,
+};
+
+static struct arena_chunk *
+arena_chunk_new(struct arena_chunk *prev, size_t need)
+{
+	size_t size = prev == NULL ? ARENA_CHUNK_MIN_SIZE : prev->size * 2;
+	if (size > ARENA_CHUNK_MAX_SIZE)
+		size = ARENA_CHUNK_MAX_SIZE;
+	if (size < need)
+		size = need;
+	struct arena_chunk *chunk = malloc(sizeof(*chunk) + size);
+	chunk->next = prev;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+static void *
+arena_chunk_alloc(struct arena_chunk *chunk, size_t size, size_t align)
+{
+	size_t pos = (chunk->used + align - 1) & ~(align - 1);
+	if (pos > chunk->size || chunk->size - pos < size)
+		return NULL;
+	chunk->used = pos + size;
+	return (char *)chunk->data + pos;
+}
+
+/** Zeroed memory owned by the line. */
+static void *
+line_alloc(struct command_line *line, size_t size, size_t align)
+{
+	void *res = arena_chunk_alloc(line->arena, size, align);
+	if (res == NULL) {
+		line->arena = arena_chunk_new(line->arena, size + align);
+		res = arena_chunk_alloc(line->arena, size, align);
+		assert(res != NULL);
+	}
+	memset(res, 0, size);
+	return res;
+}
+
+#define line_new(line, type) \
+	((type *)line_alloc((line), sizeof(type), _Alignof(type)))
+
+static struct command_line *
+command_line_new(void)
+{
+	struct arena_chunk *chunk = arena_chunk_new(NULL, 0);
+	struct command_line *line =
+		arena_chunk_alloc(chunk, sizeof(*line), _Alignof(struct command_line));
+	memset(line, 0, sizeof(*line));
+	line->arena = chunk;
+	return line;
+}
+
+static char *
+line_strdup(struct command_line *line, const struct token *t)
+{
+	assert(t->type == TOKEN_TYPE_STR);
+	char *res = arena_chunk_alloc(line->arena, t->size + 1, 1);
+	if (res == NULL)
+		res = line_alloc(line, t->size + 1, 1);
+	memcpy(res, t->data, t->size);
+	res[t->size] = 0;
+	return res;
+}
+
+static void
+command_append_arg(struct command_line *line, struct command *cmd, char *arg)
 {
 	if (cmd->arg_count == cmd->arg_capacity) {
-		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		/* The old array stays in the arena till the line is freed. */
+		uint32_t capacity = (cmd->arg_capacity + 1) * 2;
+		char **args = line_alloc(line, sizeof(*args) * capacity,
+					 _Alignof(char *));
+		if (cmd->arg_count > 0)
+			memcpy(args, cmd->args, sizeof(*args) * cmd->arg_count);
+		cmd->args = args;
+		cmd->arg_capacity = capacity;
 	} else {
 		assert(cmd->arg_count < cmd->arg_capacity);
 	}
@@ -73,20 +226,13 @@ static void command_append_arg(struct command *cmd, char *arg)
 
 void command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
+	/* The line itself is in the first chunk. */
+	struct arena_chunk *chunk = line->arena;
+	while (chunk != NULL) {
+		struct arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
 	}
-	free(line->out_file);
-	free(line);
 }
 
 static void command_line_append(struct command_line *line, struct expr *e)
@@ -106,6 +252,22 @@ struct parser* parser_new(void)
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
+	uint32_t rest = p->size - p->pos;
+	if (p->input != p->buffer) {
+		/* Keep what is left of the view. */
+		const char *view = p->input + p->pos;
+		p->input = p->buffer;
+		p->size = p->pos = 0;
+		if (rest > 0)
+			parser_feed(p, view, rest);
+	} else if (rest == 0) {
+		p->size = p->pos = 0;
+	} else if (p->capacity - p->size < len && p->pos > 0) {
+		/* Drop the scanned prefix, only the unscanned rest moves. */
+		memmove(p->buffer, p->buffer + p->pos, rest);
+		p->size = rest;
+		p->pos = 0;
+	}
 	uint32_t cap = p->capacity - p->size;
 	if (cap < len) {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
@@ -113,326 +275,458 @@ parser_feed(struct parser *p, const char *str, uint32_t len)
 			new_capacity = p->size + len;
 		p->buffer = realloc(p->buffer, sizeof(*p->buffer) * new_capacity);
 		p->capacity = new_capacity;
+		p->input = p->buffer;
 	}
 	memcpy(p->buffer + p->size, str, len);
 	p->size += len;
 	assert(p->size <= p->capacity);
 }
 
-static void
-parser_consume(struct parser *p, uint32_t size)
+void
+parser_feed_view(struct parser *p, const char *str, uint32_t len)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
-		p->size = 0;
+	if (p->pos < p->size) {
+		/* Can't scan two pieces at once, fall back to a copy. */
+		parser_feed(p, str, len);
 		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
+	p->input = str;
+	p->size = len;
+	p->pos = 0;
+}
+
+/**
+ * Bytes which end or change a word outside of quotes. All the other
+ * bytes are copied into the word as is.
+ */
+static bool
+is_word_special(char c)
+{
+	switch (c) {
+	case ' ': case '\t': case '\r': case '\n':
+	case '\'': case '"': case '\\':
+	case '&': case '|': case '>': case '#':
+		return true;
+	default:
+		return false;
+	}
 }
 
+#if defined(__AVX2__)
+
+/** Bytes <= ' ' and the special punctuation, 32 at a time. */
+static inline uint32_t
+word_special_mask(const char *pos)
+{
+	__m256i x = _mm256_loadu_si256((const __m256i *)pos);
+	__m256i r = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(' ')), x);
+	r = _mm256_or_si256(r, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\'')));
+	r = _mm256_or_si256(r, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')));
+	r = _mm256_or_si256(r, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\')));
+	r = _mm256_or_si256(r, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('&')));
+	r = _mm256_or_si256(r, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('|')));
+	r = _mm256_or_si256(r, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('>')));
+	r = _mm256_or_si256(r, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('#')));
+	return (uint32_t)_mm256_movemask_epi8(r);
+}
+
+static inline uint32_t
+quoted_special_mask(const char *pos, char quote)
+{
+	__m256i x = _mm256_loadu_si256((const __m256i *)pos);
+	__m256i r = _mm256_cmpeq_epi8(x, _mm256_set1_epi8(quote));
+	if (quote == '"')
+		r = _mm256_or_si256(r, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\')));
+	return (uint32_t)_mm256_movemask_epi8(r);
+}
+
+#define SCAN_BLOCK 32
+
+#elif defined(__SSE2__)
+
+/** Bytes <= ' ' and the special punctuation, 16 at a time. */
+static inline uint32_t
+word_special_mask(const char *pos)
+{
+	__m128i x = _mm_loadu_si128((const __m128i *)pos);
+	__m128i r = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(' ')), x);
+	r = _mm_or_si128(r, _mm_cmpeq_epi8(x, _mm_set1_epi8('\'')));
+	r = _mm_or_si128(r, _mm_cmpeq_epi8(x, _mm_set1_epi8('"')));
+	r = _mm_or_si128(r, _mm_cmpeq_epi8(x, _mm_set1_epi8('\\')));
+	r = _mm_or_si128(r, _mm_cmpeq_epi8(x, _mm_set1_epi8('&')));
+	r = _mm_or_si128(r, _mm_cmpeq_epi8(x, _mm_set1_epi8('|')));
+	r = _mm_or_si128(r, _mm_cmpeq_epi8(x, _mm_set1_epi8('>')));
+	r = _mm_or_si128(r, _mm_cmpeq_epi8(x, _mm_set1_epi8('#')));
+	return (uint32_t)_mm_movemask_epi8(r);
+}
+
+static inline uint32_t
+quoted_special_mask(const char *pos, char quote)
+{
+	__m128i x = _mm_loadu_si128((const __m128i *)pos);
+	__m128i r = _mm_cmpeq_epi8(x, _mm_set1_epi8(quote));
+	if (quote == '"')
+		r = _mm_or_si128(r, _mm_cmpeq_epi8(x, _mm_set1_epi8('\\')));
+	return (uint32_t)_mm_movemask_epi8(r);
+}
+
+#define SCAN_BLOCK 16
+
+#endif
+
+/**
+ * Length of the plain prefix of a word outside of quotes. The
+ * vector path stops at any control byte too, then the caller
+ * takes that one byte alone.
+ */
 static uint32_t
-parse_token(const char *pos, const char *end, struct token *out)
+scan_word(const char *pos, const char *end)
 {
-	token_reset(out);
 	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
-		}
+#ifdef SCAN_BLOCK
+	while (end - pos >= SCAN_BLOCK) {
+		uint32_t mask = word_special_mask(pos);
+		if (mask != 0)
+			return pos - begin + __builtin_ctz(mask);
+		pos += SCAN_BLOCK;
+	}
+#endif
+	while (pos < end && !is_word_special(*pos))
 		++pos;
+	return pos - begin;
+}
+
+/** Length of the plain prefix inside the quotes. */
+static uint32_t
+scan_quoted(const char *pos, const char *end, char quote)
+{
+	const char *begin = pos;
+#ifdef SCAN_BLOCK
+	while (end - pos >= SCAN_BLOCK) {
+		uint32_t mask = quoted_special_mask(pos, quote);
+		if (mask != 0)
+			return pos - begin + __builtin_ctz(mask);
+		pos += SCAN_BLOCK;
 	}
-	char quote = 0;
-	while (pos < end) {
-		char c = *pos;
-		switch(c) {
-		case '\'':
-		case '"':
-			if (quote == 0) {
-				quote = c;
+#endif
+	while (pos < end && *pos != quote && !(quote == '"' && *pos == '\\'))
+		++pos;
+	return pos - begin;
+}
+
+/** Finish the current token, the next scan starts a new one. */
+static void
+parser_token_done(struct parser *p, enum token_type type)
+{
+	p->token.type = type;
+	p->token_state = TOKEN_STATE_START;
+	p->quote = 0;
+}
+
+static enum token_type
+operator_token_type(char op, bool is_double)
+{
+	switch (op) {
+	case '&':
+		return is_double ? TOKEN_TYPE_AND : TOKEN_TYPE_BACKGROUND;
+	case '|':
+		return is_double ? TOKEN_TYPE_OR : TOKEN_TYPE_PIPE;
+	case '>':
+		return is_double ? TOKEN_TYPE_OUT_APPEND : TOKEN_TYPE_OUT_NEW;
+	default:
+		assert(false);
+		return TOKEN_TYPE_NONE;
+	}
+}
+
+/**
+ * Scan the next token starting where the previous scan stopped.
+ * @retval true The token is complete, see p->token.
+ * @retval false The input ended first. The state is kept in the
+ *     parser, the scan continues after the next feed.
+ */
+static bool
+parser_next_token(struct parser *p)
+{
+	struct token *t = &p->token;
+	if (t->type != TOKEN_TYPE_NONE)
+		token_reset(t);
+	const char *buf = p->input;
+	uint32_t pos = p->pos;
+	uint32_t end = p->size;
+	while (t->type == TOKEN_TYPE_NONE && pos < end) {
+		char c = buf[pos];
+		switch (p->token_state) {
+		case TOKEN_STATE_START:
+			if (c == '\n') {
+				++pos;
+				parser_token_done(p, TOKEN_TYPE_NEW_LINE);
+			} else if (isspace(c)) {
 				++pos;
-				if (pos == end)
-					return 0;
+			} else {
+				p->token_state = TOKEN_STATE_WORD;
+			}
+			continue;
+		case TOKEN_STATE_COMMENT: {
+			const char *nl = memchr(buf + pos, '\n', end - pos);
+			if (nl == NULL) {
+				pos = end;
 				continue;
 			}
-			if (quote != c)
-				goto append_and_next;
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\\':
-			if (quote == '\'')
-				goto append_and_next;
-			if (quote == '"') {
+			pos = nl + 1 - buf;
+			parser_token_done(p, TOKEN_TYPE_NEW_LINE);
+			continue;
+		}
+		case TOKEN_STATE_OPERATOR:
+			if (c == p->op)
 				++pos;
-				if (pos == end)
-					return 0;
-				c = *pos;
-				switch (c)
-				{
-				case '\\':
-					goto append_and_next;
-				case '\n':
-					++pos;
-					continue;
-				case '"':
-					goto append_and_next;
-				default:
-					break;
-				}
-				token_append(out, '\\');
-				goto append_and_next;
-			}
-			assert(quote == 0);
+			parser_token_done(p, operator_token_type(p->op, c == p->op));
+			continue;
+		case TOKEN_STATE_ESCAPE:
 			++pos;
-			if (pos == end)
-				return 0;
-			c = *pos;
-			if (c == '\n') {
-				++pos;
+			p->token_state = TOKEN_STATE_WORD;
+			/* Escaped new line is a line continuation. */
+			if (c == '\n')
+				continue;
+			if (p->quote == '"' && c != '\\' && c != '"')
+				token_append(t, '\\');
+			token_append(t, c);
+			continue;
+		case TOKEN_STATE_WORD:
+			break;
+		}
+		if (p->quote != 0) {
+			uint32_t len = scan_quoted(buf + pos, buf + end, p->quote);
+			if (len > 0) {
+				token_append_n(t, buf + pos, len);
+				pos += len;
 				continue;
 			}
-			goto append_and_next;
+			++pos;
+			if (c == p->quote)
+				parser_token_done(p, TOKEN_TYPE_STR);
+			else
+				p->token_state = TOKEN_STATE_ESCAPE;
+			continue;
+		}
+		switch (c) {
+		case '\'':
+		case '"':
+			p->quote = c;
+			++pos;
+			break;
+		case '\\':
+			p->token_state = TOKEN_STATE_ESCAPE;
+			++pos;
+			break;
 		case '&':
 		case '|':
 		case '>':
-			if (quote != 0)
-				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
+			if (t->size > 0) {
+				parser_token_done(p, TOKEN_TYPE_STR);
+				break;
 			}
+			p->op = c;
+			p->token_state = TOKEN_STATE_OPERATOR;
 			++pos;
-			if (pos == end)
-				return 0;
-			if (*pos == c) {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_AND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_OR;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_APPEND;
-					break;
-				default:
-					assert(false);
-					break;
-				}
-				++pos;
-			} else {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_BACKGROUND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_PIPE;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_NEW;
-					break;
-				default:
-					assert(false);
-					break;
-				}
-			}
-			return pos - begin;
+			break;
 		case ' ':
 		case '\t':
 		case '\r':
-			if (quote != 0)
-				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
+			++pos;
+			if (t->size > 0)
+				parser_token_done(p, TOKEN_TYPE_STR);
+			else
+				p->token_state = TOKEN_STATE_START;
+			break;
 		case '\n':
-			if (quote != 0)
-				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos - begin;
+			/* The new line is a token of its own. */
+			if (t->size > 0)
+				parser_token_done(p, TOKEN_TYPE_STR);
+			else
+				p->token_state = TOKEN_STATE_START;
+			break;
 		case '#':
-			if (quote != 0)
-				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
+			if (t->size > 0) {
+				parser_token_done(p, TOKEN_TYPE_STR);
+				break;
 			}
+			p->token_state = TOKEN_STATE_COMMENT;
 			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
-		default:
-			goto append_and_next;
+			break;
+		default: {
+			uint32_t len = scan_word(buf + pos, buf + end);
+			/* A control byte, plain in a word. */
+			if (len == 0)
+				len = 1;
+			token_append_n(t, buf + pos, len);
+			pos += len;
+			break;
 		}
-	append_and_next:
-		token_append(out, c);
-		++pos;
+		}
+	}
+	p->pos = pos;
+	return t->type != TOKEN_TYPE_NONE;
+}
+
+static struct command_line *
+parser_line(struct parser *p)
+{
+	if (p->line == NULL)
+		p->line = command_line_new();
+	return p->line;
+}
+
+/** Drop the current line and skip the input till its end. */
+static void
+parser_fail(struct parser *p, enum parser_error error)
+{
+	if (p->line != NULL) {
+		command_line_delete(p->line);
+		p->line = NULL;
+	}
+	p->error = error;
+	p->line_state = LINE_STATE_SKIP;
+}
+
+/** Append an operator after a command, or fail. */
+static void
+parser_append_operator(struct parser *p, enum expr_type type,
+		       enum parser_error no_left_arg,
+		       enum parser_error left_arg_not_a_command)
+{
+	struct command_line *line = parser_line(p);
+	if (line->tail == NULL) {
+		parser_fail(p, no_left_arg);
+		return;
+	}
+	if (line->tail->type != EXPR_TYPE_COMMAND) {
+		parser_fail(p, left_arg_not_a_command);
+		return;
+	}
+	struct expr *e = line_new(line, struct expr);
+	e->type = type;
+	command_line_append(line, e);
+}
+
+/** The line end is reached. */
+static enum parser_error
+parser_end_line(struct parser *p, struct command_line **out)
+{
+	struct command_line *line = p->line;
+	enum parser_error res = PARSER_ERR_NONE;
+	p->line = NULL;
+	if (p->line_state == LINE_STATE_SKIP) {
+		res = p->error;
+	} else if (p->line_state == LINE_STATE_OUT_FILE) {
+		res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+	} else if (line->tail == NULL || line->tail->type != EXPR_TYPE_COMMAND) {
+		res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+	} else {
+		*out = line;
+		line = NULL;
 	}
-	return 0;
+	if (line != NULL)
+		command_line_delete(line);
+	p->line_state = LINE_STATE_COMMANDS;
+	return res;
 }
 
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
-	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
 	enum parser_error res = PARSER_ERR_NONE;
-
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+	*out = NULL;
+	while (parser_next_token(p)) {
+		struct token *t = &p->token;
+		if (t->type == TOKEN_TYPE_NEW_LINE) {
+			/* Skip empty lines. */
+			if (p->line_state == LINE_STATE_COMMANDS &&
+			    (p->line == NULL || p->line->tail == NULL))
+				continue;
+			res = parser_end_line(p, out);
+			break;
+		}
+		struct command_line *line;
+		switch (p->line_state) {
+		case LINE_STATE_SKIP:
+			continue;
+		case LINE_STATE_OUT_FILE:
+			if (t->type != TOKEN_TYPE_STR) {
+				parser_fail(p, PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
+				continue;
+			}
+			p->line->out_file = line_strdup(p->line, t);
+			p->line_state = LINE_STATE_AFTER_OUT;
+			continue;
+		case LINE_STATE_AFTER_OUT:
+			if (t->type != TOKEN_TYPE_BACKGROUND) {
+				parser_fail(p, PARSER_ERR_TOO_LATE_ARGUMENTS);
+				continue;
+			}
+			p->line->is_background = true;
+			p->line_state = LINE_STATE_AFTER_BACKGROUND;
+			continue;
+		case LINE_STATE_AFTER_BACKGROUND:
+			parser_fail(p, PARSER_ERR_TOO_LATE_ARGUMENTS);
+			continue;
+		case LINE_STATE_COMMANDS:
+			break;
+		}
+		line = parser_line(p);
 		struct expr *e;
-		switch(token.type) {
+		switch (t->type) {
 		case TOKEN_TYPE_STR:
 			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
+				command_append_arg(line, &line->tail->cmd,
+						   line_strdup(line, t));
 				continue;
 			}
-			e = calloc(1, sizeof(*e));
+			e = line_new(line, struct expr);
 			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
+			e->cmd.exe = line_strdup(line, t);
 			command_line_append(line, e);
 			continue;
-		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->tail == NULL)
-				continue;
-			goto close_and_return;
 		case TOKEN_TYPE_PIPE:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
+			parser_append_operator(p, EXPR_TYPE_PIPE,
+					       PARSER_ERR_PIPE_WITH_NO_LEFT_ARG,
+					       PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND);
 			continue;
 		case TOKEN_TYPE_AND:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
+			parser_append_operator(p, EXPR_TYPE_AND,
+					       PARSER_ERR_AND_WITH_NO_LEFT_ARG,
+					       PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND);
 			continue;
 		case TOKEN_TYPE_OR:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
+			parser_append_operator(p, EXPR_TYPE_OR,
+					       PARSER_ERR_OR_WITH_NO_LEFT_ARG,
+					       PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND);
 			continue;
 		case TOKEN_TYPE_OUT_NEW:
 		case TOKEN_TYPE_OUT_APPEND:
+			if (t->type == TOKEN_TYPE_OUT_NEW)
+				line->out_type = OUTPUT_TYPE_FILE_NEW;
+			else
+				line->out_type = OUTPUT_TYPE_FILE_APPEND;
+			p->line_state = LINE_STATE_OUT_FILE;
+			continue;
 		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
+			line->is_background = true;
+			p->line_state = LINE_STATE_AFTER_BACKGROUND;
+			continue;
 		default:
 			assert(false);
 		}
 	}
-	goto return_no_line;
-
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
-		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
-		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
-		if (line->tail->type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
-		}
-		res = PARSER_ERR_NONE;
-		*out = line;
-		goto return_final;
-	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
-
-return_error:
-	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
-	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
-		}
-	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
-
-return_no_line:
-	command_line_delete(line);
-	*out = NULL;
-
-return_final:
-	free(token.data);
 	return res;
 }
 
 void
 parser_delete(struct parser *p)
 {
+	if (p->line != NULL)
+		command_line_delete(p->line);
+	free(p->token.data);
 	free(p->buffer);
 	free(p);
 }
@@ -49,6 +49,12 @@ enum output_type
 	OUTPUT_TYPE_FILE_APPEND,
 };
 
+struct arena_chunk;
+
+/**
+ * A parsed line. All its exprs, arrays and strings are allocated
+ * in its own arena, and are freed together by command_line_delete().
+ */
 struct command_line 
 {
 	struct expr* head;
@@ -56,6 +62,8 @@ struct command_line
 	enum output_type out_type;
 	char* out_file;
 	bool is_background;
+	/** Memory of the line and everything in it. */
+	struct arena_chunk* arena;
 };
 
 void command_line_delete(struct command_line* line);
@@ -64,6 +72,13 @@ struct parser* parser_new(void);
 
 void parser_feed(struct parser* p, const char* str, uint32_t len);
 
+/**
+ * Same as parser_feed(), but without a copy when nothing fed before
+ * is left to scan. The memory must stay valid until
+ * parser_pop_next() returns no line, or until the next feed.
+ */
+void parser_feed_view(struct parser* p, const char* str, uint32_t len);
+
 enum parser_error parser_pop_next(struct parser* p, struct command_line** out);
 
 void parser_delete(struct parser* p);
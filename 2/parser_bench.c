@@ -0,0 +1,171 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Parser throughput on big generated scripts, in MB/s. Each script
+ * is parsed fed whole, and fed in 1024 byte pieces like mybash
+ * reads it from stdin.
+ *
+ * Usage: ./parser_bench [script_size_mb]
+ */
+
+struct script {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+script_append(struct script *s, const char *str, size_t len)
+{
+	if (s->capacity - s->size < len) {
+		s->capacity = (s->capacity + len) * 2;
+		s->data = realloc(s->data, s->capacity);
+		if (s->data == NULL)
+			abort();
+	}
+	memcpy(s->data + s->size, str, len);
+	s->size += len;
+}
+
+static void
+script_append_str(struct script *s, const char *str)
+{
+	script_append(s, str, strlen(str));
+}
+
+static void
+script_append_word(struct script *s, size_t len, char c)
+{
+	for (size_t i = 0; i < len; ++i)
+		script_append(s, &c, 1);
+}
+
+/** Pipelines of short words, redirects and comments. */
+static void
+gen_short_lines(struct script *s, size_t size)
+{
+	while (s->size < size) {
+		script_append_str(s, "ls -la /tmp | grep -v foo | wc -l > out.txt\n");
+		script_append_str(s, "echo 'hello world' >> log.txt # a comment\n");
+		script_append_str(s, "cd .. && mkdir -p some/dir || echo \"fail\"\n");
+	}
+}
+
+/** Many long unquoted arguments. */
+static void
+gen_long_words(struct script *s, size_t size)
+{
+	while (s->size < size) {
+		script_append_str(s, "touch");
+		for (int i = 0; i < 10; ++i) {
+			script_append_str(s, " ");
+			script_append_word(s, 200, 'a' + i);
+		}
+		script_append_str(s, "\n");
+	}
+}
+
+/** Long quoted arguments with spaces inside. */
+static void
+gen_long_quoted(struct script *s, size_t size)
+{
+	while (s->size < size) {
+		script_append_str(s, "echo \"");
+		for (int i = 0; i < 100; ++i)
+			script_append_str(s, "lorem ipsum dolor sit amet ");
+		script_append_str(s, "\" '");
+		for (int i = 0; i < 100; ++i)
+			script_append_str(s, "consectetur adipiscing elit ");
+		script_append_str(s, "'\n");
+	}
+}
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+parse_all(struct parser *p)
+{
+	size_t count = 0;
+	struct command_line *line = NULL;
+	while (true) {
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		if (line != NULL) {
+			command_line_delete(line);
+			++count;
+		}
+	}
+	return count;
+}
+
+static void
+bench_script(const char *name, const struct script *s)
+{
+	struct parser *p = parser_new();
+	double start = now_sec();
+	size_t count = 0;
+	for (size_t pos = 0; pos < s->size; pos += 1 << 30) {
+		size_t len = s->size - pos < (1 << 30) ? s->size - pos : 1 << 30;
+		parser_feed_view(p, s->data + pos, len);
+		count += parse_all(p);
+	}
+	double whole = now_sec() - start;
+	parser_delete(p);
+
+	p = parser_new();
+	start = now_sec();
+	size_t count_pieces = 0;
+	for (size_t pos = 0; pos < s->size; pos += 1024) {
+		size_t len = s->size - pos < 1024 ? s->size - pos : 1024;
+		parser_feed(p, s->data + pos, len);
+		count_pieces += parse_all(p);
+	}
+	double pieces = now_sec() - start;
+	parser_delete(p);
+
+	if (count != count_pieces) {
+		fprintf(stderr, "%s: %zu lines whole, %zu in pieces\n", name,
+			count, count_pieces);
+		abort();
+	}
+	double mb = s->size / (1024.0 * 1024.0);
+	printf("%-16s %8zu lines   whole %8.1f MB/s   1K pieces %8.1f MB/s\n",
+	       name, count, mb / whole, mb / pieces);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size = 64;
+	if (argc > 1)
+		size = strtoul(argv[1], NULL, 10);
+	size *= 1024 * 1024;
+
+	struct {
+		const char *name;
+		void (*gen)(struct script *, size_t);
+	} cases[] = {
+		{"short lines", gen_short_lines},
+		{"long words", gen_long_words},
+		{"long quoted", gen_long_quoted},
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		struct script s = {0};
+		cases[i].gen(&s, size);
+		bench_script(cases[i].name, &s);
+		free(s.data);
+	}
+	return 0;
+}
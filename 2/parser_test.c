@@ -2,6 +2,8 @@
 
 #include "unit.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static void
@@ -604,6 +606,122 @@ test_multiline_string(void)
 	unit_test_finish();
 }
 
+static void
+test_long_token_in_pieces(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	/* echo "xx...x" '' y, fed in pieces like from read(). */
+	const uint32_t arg_len = 1024 * 1024;
+	uint32_t len = arg_len + 16;
+	char *str = malloc(len);
+	uint32_t size = 0;
+	memcpy(str, "echo \"", 6);
+	size += 6;
+	memset(str + size, 'x', arg_len);
+	size += arg_len;
+	memcpy(str + size, "\" '' y\n", 7);
+	size += 7;
+	for (uint32_t i = 0; i < size; i += 1000) {
+		uint32_t piece = size - i < 1000 ? size - i : 1000;
+		parser_feed(p, str + i, piece);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if((line != NULL) != (i + piece == size));
+	}
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 3, "arg count");
+	unit_check(strlen(e->cmd.args[0]) == arg_len, "long arg");
+	unit_check(strcmp(e->cmd.args[1], "") == 0, "empty arg");
+	unit_check(strcmp(e->cmd.args[2], "y") == 0, "last arg");
+	command_line_delete(line);
+	free(str);
+
+	unit_msg("Line continuation at the token start");
+	const char *cont = "\\\n ls\n";
+	parser_feed(p, cont, strlen(cont));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "ls") == 0, "exe");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_feed_view(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	char view[] = "ls -l\npwd\necho \"a";
+	parser_feed_view(p, view, strlen(view));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "ls") == 0, "exe");
+	command_line_delete(line);
+
+	unit_msg("Feed copies the unscanned rest of the view");
+	parser_feed(p, "b\"\n", 3);
+	memset(view, 0, sizeof(view));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "pwd") == 0, "exe");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "echo") == 0, "exe");
+	unit_check(strcmp(line->head->cmd.args[0], "ab") == 0, "arg[0]");
+	command_line_delete(line);
+
+	unit_msg("The partial token outlives the view");
+	char view2[] = "echo \"c";
+	parser_feed_view(p, view2, strlen(view2));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no line yet");
+	memset(view2, 0, sizeof(view2));
+	parser_feed_view(p, "d\"\n", 3);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.args[0], "cd") == 0, "arg[0]");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_many_args(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const uint32_t count = 100000;
+	parser_feed(p, "echo", 4);
+	char buf[32];
+	for (uint32_t i = 0; i < count; ++i) {
+		int len = snprintf(buf, sizeof(buf), " arg%u", i);
+		parser_feed(p, buf, len);
+	}
+	parser_feed(p, " | wc -l\n", 9);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(e->cmd.arg_count == count, "arg count");
+	bool is_ok = true;
+	for (uint32_t i = 0; i < count && is_ok; ++i) {
+		snprintf(buf, sizeof(buf), "arg%u", i);
+		is_ok = strcmp(e->cmd.args[i], buf) == 0;
+	}
+	unit_check(is_ok, "args");
+	e = e->next->next;
+	unit_check(strcmp(e->cmd.exe, "wc") == 0, "exe");
+	unit_check(strcmp(e->cmd.args[0], "-l") == 0, "arg[0]");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_logical_operators(void)
 {
@@ -831,6 +949,9 @@ main(void)
 	test_pipe();
 	test_comments();
 	test_multiline_string();
+	test_long_token_in_pieces();
+	test_feed_view();
+	test_many_args();
 	test_logical_operators();
 	test_background();
 	test_errors();
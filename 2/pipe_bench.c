@@ -0,0 +1,111 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Pipeline throughput of mybash, in MB/s. A big file is pushed
+ * through multi-stage pipelines of the builtin cat, which splices,
+ * and of /bin/cat, with the default and bigger pipe capacities set
+ * via MYBASH_PIPE_SIZE.
+ *
+ * Usage: ./pipe_bench [file_size_mb] [mybash_path]
+ */
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+write_file(const char *path, size_t size)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		abort();
+	char block[65536];
+	for (size_t i = 0; i < sizeof(block); ++i)
+		block[i] = 'a' + i % 26;
+	for (size_t done = 0; done < size; done += sizeof(block)) {
+		size_t len = size - done < sizeof(block) ?
+			     size - done : sizeof(block);
+		if (fwrite(block, 1, len, f) != len)
+			abort();
+	}
+	fclose(f);
+}
+
+static double
+run_script(const char *shell, const char *script, const char *pipe_size)
+{
+	if (pipe_size != NULL)
+		setenv("MYBASH_PIPE_SIZE", pipe_size, 1);
+	else
+		unsetenv("MYBASH_PIPE_SIZE");
+	double start = now_sec();
+	pid_t pid = fork();
+	if (pid < 0)
+		abort();
+	if (pid == 0) {
+		execl(shell, shell, script, (char *)NULL);
+		perror(shell);
+		_exit(127);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed\n", shell);
+		abort();
+	}
+	return now_sec() - start;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size_mb = 1024;
+	if (argc > 1)
+		size_mb = strtoul(argv[1], NULL, 10);
+	const char *shell = argc > 2 ? argv[2] : "./mybash";
+
+	char data_path[] = "/tmp/pipe_bench_data_XXXXXX";
+	char script_path[] = "/tmp/pipe_bench_script_XXXXXX";
+	close(mkstemp(data_path));
+	close(mkstemp(script_path));
+	write_file(data_path, size_mb * 1024 * 1024);
+
+	struct {
+		const char *name;
+		const char *format;
+	} pipelines[] = {
+		{"4 x cat", "cat %s | cat | cat | cat > /dev/null\n"},
+		{"4 x /bin/cat", "/bin/cat %s | /bin/cat | /bin/cat | "
+				 "/bin/cat > /dev/null\n"},
+		{"cat | wc", "cat %s | wc -c > /dev/null\n"},
+	};
+	const char *pipe_sizes[] = {NULL, "256K", "1M"};
+
+	for (size_t i = 0; i < sizeof(pipelines) / sizeof(pipelines[0]); ++i) {
+		FILE *f = fopen(script_path, "w");
+		if (f == NULL)
+			abort();
+		fprintf(f, pipelines[i].format, data_path);
+		fclose(f);
+		for (size_t j = 0; j < sizeof(pipe_sizes) / sizeof(pipe_sizes[0]);
+		     ++j) {
+			double sec = run_script(shell, script_path, pipe_sizes[j]);
+			printf("%-14s pipe %-8s %8.1f MB/s\n", pipelines[i].name,
+			       pipe_sizes[j] != NULL ? pipe_sizes[j] : "default",
+			       size_mb / sec);
+		}
+	}
+	unlink(script_path);
+	unlink(data_path);
+	return 0;
+}
@@ -1,16 +1,36 @@
+#define _GNU_SOURCE /* pipe2, memfd_create, splice, F_SETPIPE_SZ, close_range */
 #include "parser.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 
 #define SIZEOF_PIPE 2
 
+/**
+ * Capacity of the pipes between the commands, from the environment
+ * variable MYBASH_PIPE_SIZE, like "1M". 0 keeps the kernel's 64KB.
+ * With bigger pipes the stages of a heavy pipeline move more data
+ * per context switch.
+ */
+static int pipe_size = 0;
+
+extern char** environ;
+
 static char** build_args(const struct command* cmd)
 {
     assert(cmd);
@@ -25,7 +45,7 @@ static char** build_args(const struct command* cmd)
 static bool open_fd(int* fd, const struct command_line* line)
 {
     assert(line);
-    int flags = O_WRONLY | O_CREAT;
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
     if (line->out_type == OUTPUT_TYPE_FILE_APPEND)
         flags |= O_APPEND;
     else
@@ -35,7 +55,7 @@ static bool open_fd(int* fd, const struct command_line* line)
     return *fd >= 0;
 }
 
-static void execute_cd(const struct command* cmd)
+static int execute_cd(const struct command* cmd)
 {
     assert(cmd);
     if (cmd->arg_count < 1) 
@@ -43,267 +63,1306 @@ static void execute_cd(const struct command* cmd)
         fprintf(stderr, "cd: missing argument\n");
         exit(EXIT_FAILURE);
     }
-    if (chdir(cmd->args[0]))
+    if (chdir(cmd->args[0])) 
+    {
         perror("Error");
+        return 1;
+    }
+    return 0;
 }
 
-static void execute_exit(const struct command* cmd, bool is_in_pipeline)
+static int execute_exit(const struct command* cmd)
 {
     assert(cmd);
     int status = 0;
     if (cmd->arg_count > 0)
         status = atoi(cmd->args[0]);
+    exit(status);
+}
 
-    if (!is_in_pipeline)
-        exit(status);
-    _exit(status);
+/**
+ * Full paths of the commands found in PATH, like the hash table of
+ * bash. A command is searched for once, then started right by its
+ * path. The table is dropped when PATH changes, and an entry - when
+ * its file is gone.
+ */
+struct path_entry
+{
+    char* name;
+    char* path;
+    unsigned hits;
+    struct path_entry* next;
+};
+
+static struct path_entry** path_buckets = NULL;
+static size_t path_bucket_count = 0;
+static size_t path_entry_count = 0;
+/** PATH the entries were found with. */
+static char* path_env = NULL;
+/**
+ * The last command found relative to the current directory, via an
+ * empty or relative PATH entry. Such ones aren't cached, a cd could
+ * make them point elsewhere, so they are searched for every time.
+ */
+static struct path_entry path_uncached = {NULL, NULL, 0, NULL};
+
+static const char* default_path = "/bin:/usr/bin";
+
+static size_t path_hash(const char* name)
+{
+    size_t h = 14695981039346656037ull;
+    for (; *name; ++name)
+        h = (h ^ (unsigned char)*name) * 1099511628211ull;
+    return h;
 }
 
-static int execute_pipeline(const struct command_line* line)
+static void path_cache_clear(void)
 {
-    assert(line);
-    int prev_pipe[SIZEOF_PIPE] = {-1, -1};
-    const struct expr* head = line->head;
-    int status = 0, exit_status = 0;
-    size_t child_count = 0, array_size = 32;
+    for (size_t i = 0; i < path_bucket_count; ++i) 
+    {
+        struct path_entry* e = path_buckets[i];
+        while (e) 
+        {
+            struct path_entry* next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        path_buckets[i] = NULL;
+    }
+    path_entry_count = 0;
+    free(path_uncached.path);
+    path_uncached.path = NULL;
+}
 
-    pid_t* array = (pid_t*) malloc(array_size * sizeof(pid_t));
-    if (!array) 
+static void path_cache_check_env(void)
+{
+    const char* env = getenv("PATH");
+    if (!env)
+        env = default_path;
+    if (path_env && !strcmp(path_env, env))
+        return;
+    path_cache_clear();
+    free(path_env);
+    path_env = strdup(env);
+}
+
+static struct path_entry** path_cache_find(const char* name)
+{
+    if (path_bucket_count == 0)
+        return NULL;
+    struct path_entry** e = &path_buckets[path_hash(name) % path_bucket_count];
+    while (*e && strcmp((*e)->name, name))
+        e = &(*e)->next;
+    return e;
+}
+
+static void path_cache_insert(struct path_entry* entry)
+{
+    if (path_entry_count >= path_bucket_count) 
     {
-        perror("malloc");
-        return 1;
+        size_t count = path_bucket_count == 0 ? 64 : path_bucket_count * 2;
+        struct path_entry** buckets = (struct path_entry**) calloc(count, sizeof(*buckets));
+        for (size_t i = 0; i < path_bucket_count; ++i) 
+        {
+            struct path_entry* e = path_buckets[i];
+            while (e) 
+            {
+                struct path_entry* next = e->next;
+                size_t b = path_hash(e->name) % count;
+                e->next = buckets[b];
+                buckets[b] = e;
+                e = next;
+            }
+        }
+        free(path_buckets);
+        path_buckets = buckets;
+        path_bucket_count = count;
     }
+    size_t b = path_hash(entry->name) % path_bucket_count;
+    entry->next = path_buckets[b];
+    path_buckets[b] = entry;
+    ++path_entry_count;
+}
 
-    while (head && head->type == EXPR_TYPE_COMMAND) 
+static void path_cache_forget(const char* name)
+{
+    struct path_entry** e = path_cache_find(name);
+    if (!e || !*e)
+        return;
+    struct path_entry* entry = *e;
+    *e = entry->next;
+    free(entry->name);
+    free(entry->path);
+    free(entry);
+    --path_entry_count;
+}
+
+/** Find the command in the table or in PATH. NULL if there is none. */
+static struct path_entry* path_cache_lookup(const char* name)
+{
+    path_cache_check_env();
+    struct path_entry** e = path_cache_find(name);
+    if (e && *e)
+        return *e;
+
+    size_t name_len = strlen(name);
+    const char* dir = path_env;
+    while (true) 
     {
-        int next_pipe[SIZEOF_PIPE] = {-1, -1};
-        bool is_last_command = !head->next || head->next->type != EXPR_TYPE_PIPE;
+        const char* dir_end = strchrnul(dir, ':');
+        size_t dir_len = dir_end - dir;
+        char* path = (char*) malloc(dir_len + name_len + 3);
+        if (dir_len == 0)
+            strcpy(path, ".");
+        else
+            memcpy(path, dir, dir_len), path[dir_len] = 0;
+        strcat(path, "/");
+        strcat(path, name);
 
-        if (!is_last_command && pipe(next_pipe) < 0) 
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) 
         {
-            perror("pipe");
-            free(array);
-            return 1;
+            if (path[0] != '/') 
+            {
+                free(path_uncached.path);
+                path_uncached.path = path;
+                return &path_uncached;
+            }
+            struct path_entry* entry = (struct path_entry*) malloc(sizeof(*entry));
+            entry->name = strdup(name);
+            entry->path = path;
+            entry->hits = 0;
+            path_cache_insert(entry);
+            return entry;
         }
+        free(path);
+        if (*dir_end == 0)
+            return NULL;
+        dir = dir_end + 1;
+    }
+}
 
-        if (child_count >= array_size) 
+static int execute_hash(const struct command* cmd)
+{
+    assert(cmd);
+    if (cmd->arg_count == 0) 
+    {
+        path_cache_check_env();
+        if (path_entry_count == 0) 
         {
-            array_size *= 2;
-            pid_t* new_array = (pid_t*) realloc(array, array_size * sizeof(pid_t));
-            if (!new_array) 
+            printf("hash: hash table empty\n");
+            return 0;
+        }
+        printf("hits\tcommand\n");
+        for (size_t i = 0; i < path_bucket_count; ++i) 
+        {
+            for (struct path_entry* e = path_buckets[i]; e; e = e->next)
+                printf("%4u\t%s\n", e->hits, e->path);
+        }
+        return 0;
+    }
+    if (!strcmp(cmd->args[0], "-r")) 
+    {
+        path_cache_clear();
+        return 0;
+    }
+    int status = 0;
+    for (uint32_t i = 0; i < cmd->arg_count; ++i) 
+    {
+        if (strchr(cmd->args[i], '/'))
+            continue;
+        if (!path_cache_lookup(cmd->args[i])) 
+        {
+            fprintf(stderr, "hash: %s: not found\n", cmd->args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * Background jobs. Each is the processes of one line started with
+ * '&'. SIGCHLD is blocked in the shell and read from a signalfd, so
+ * the finished jobs are reaped as soon as the shell gets to it,
+ * even when it waits for input.
+ */
+struct job
+{
+    pid_t* pids;
+    size_t pid_count;
+    size_t running;
+};
+
+static struct job* jobs = NULL;
+static size_t job_count = 0;
+static size_t job_capacity = 0;
+static int sigchld_fd = -1;
+
+static void jobs_add(pid_t* pids, size_t pid_count)
+{
+    size_t running = 0;
+    for (size_t i = 0; i < pid_count; ++i)
+        running += pids[i] > 0;
+    if (running == 0) 
+    {
+        free(pids);
+        return;
+    }
+    if (job_count == job_capacity) 
+    {
+        job_capacity = job_capacity == 0 ? 16 : job_capacity * 2;
+        jobs = (struct job*) realloc(jobs, job_capacity * sizeof(*jobs));
+    }
+    struct job* job = &jobs[job_count++];
+    job->pids = pids;
+    job->pid_count = pid_count;
+    job->running = running;
+}
+
+static void jobs_clear(void)
+{
+    for (size_t i = 0; i < job_count; ++i)
+        free(jobs[i].pids);
+    job_count = 0;
+}
+
+static void jobs_on_exit(pid_t pid)
+{
+    for (size_t i = 0; i < job_count; ++i) 
+    {
+        struct job* job = &jobs[i];
+        for (size_t j = 0; j < job->pid_count; ++j) 
+        {
+            if (job->pids[j] != pid)
+                continue;
+            job->pids[j] = -1;
+            if (--job->running == 0) 
             {
-                perror("realloc");
-                free(array);
-                return 1;
+                free(job->pids);
+                *job = jobs[--job_count];
             }
-            array = new_array;
+            return;
         }
+    }
+}
 
-        pid_t pid = fork();
+/**
+ * Reap the finished jobs. Called only between the lines, when the
+ * shell has no foreground children, so any exited child is a job.
+ */
+static void jobs_reap(bool is_blocking)
+{
+    while (job_count > 0) 
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, is_blocking ? 0 : WNOHANG);
+        if (pid == 0)
+            break;
         if (pid < 0) 
         {
-            perror("fork");
-            free(array);
-            return 1;
+            if (errno == EINTR)
+                continue;
+            /* No children left, the rest are not ours. */
+            jobs_clear();
+            break;
         }
-        else if (pid == 0) 
-        {
-            free(array);
+        jobs_on_exit(pid);
+    }
+}
+
+static void jobs_reap_if_signaled(void)
+{
+    if (sigchld_fd < 0)
+        return;
+    struct signalfd_siginfo info[16];
+    bool is_signaled = false;
+    while (read(sigchld_fd, info, sizeof(info)) > 0)
+        is_signaled = true;
+    if (is_signaled)
+        jobs_reap(false);
+}
+
+static int execute_wait(const struct command* cmd)
+{
+    (void)cmd;
+    jobs_reap(true);
+    return 0;
+}
+
+static int execute_true(const struct command* cmd)
+{
+    (void)cmd;
+    return 0;
+}
+
+static int execute_false(const struct command* cmd)
+{
+    (void)cmd;
+    return 1;
+}
+
+/** -n, -nn and so on. Bash and /bin/echo take all of them. */
+static bool echo_is_n_option(const char* arg)
+{
+    return arg[0] == '-' && arg[1] != 0 && strspn(arg + 1, "n") == strlen(arg + 1);
+}
+
+/** Count of the leading -n options. */
+static uint32_t echo_n_option_count(const struct command* cmd)
+{
+    uint32_t i = 0;
+    while (i < cmd->arg_count && echo_is_n_option(cmd->args[i]))
+        ++i;
+    return i;
+}
+
+/** Any other option after the -n ones goes to /bin/echo. */
+static bool echo_is_supported(const struct command* cmd)
+{
+    uint32_t i = echo_n_option_count(cmd);
+    return i == cmd->arg_count || cmd->args[i][0] != '-' || !strcmp(cmd->args[i], "-");
+}
 
-            if (prev_pipe[0] != -1) 
+static int execute_echo(const struct command* cmd)
+{
+    assert(cmd);
+    uint32_t i = echo_n_option_count(cmd);
+    bool is_newline = i == 0;
+    for (uint32_t first = i; i < cmd->arg_count; ++i) 
+    {
+        if (i > first)
+            putchar(' ');
+        fputs(cmd->args[i], stdout);
+    }
+    if (is_newline)
+        putchar('\n');
+    return 0;
+}
+
+static int execute_pwd(const struct command* cmd)
+{
+    (void)cmd;
+    char* cwd = getcwd(NULL, 0);
+    if (!cwd) 
+    {
+        perror("pwd");
+        return 1;
+    }
+    puts(cwd);
+    free(cwd);
+    return 0;
+}
+
+/** The char of the escape after a backslash, -1 if unknown. */
+static int printf_escape(char letter)
+{
+    switch (letter) 
+    {
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    case 'a': return '\a';
+    case 'b': return '\b';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case '\\': return '\\';
+    default: return -1;
+    }
+}
+
+/** A number as bash reads it for the conversion, no 'c or junk. */
+static bool printf_is_number(const char* arg, char conversion)
+{
+    char* end = NULL;
+    errno = 0;
+    if (conversion == 'd' || conversion == 'i')
+        strtoll(arg, &end, 0);
+    else
+        strtoull(arg, &end, 0);
+    return errno == 0 && *end == 0;
+}
+
+/**
+ * Go through the format the way printf does. It is reused while
+ * there are arguments left, the missing ones are empty strings and
+ * zeros. The builtin knows the conversions s, c, d, i, u, o, x, X
+ * with flags, width and precision, and the one letter escapes. The
+ * rest, like %f, %b, * widths, \NNN or \xHH, is left to the real
+ * printf, as are the numbers it reads differently from bash, like 'a.
+ * @param is_dry_run Only check, print nothing.
+ *
+ * @retval false Something the builtin doesn't know was met.
+ */
+static bool printf_format(const struct command* cmd, bool is_dry_run)
+{
+    const char* format = cmd->args[0];
+    uint32_t next = 1, start;
+    do 
+    {
+        start = next;
+        for (const char* c = format; *c; ++c) 
+        {
+            if (*c == '\\' && c[1] != 0) 
             {
-                dup2(prev_pipe[0], STDIN_FILENO);
-                close(prev_pipe[0]);
-                close(prev_pipe[1]);
+                int escape = printf_escape(*++c);
+                if (escape < 0)
+                    return false;
+                if (!is_dry_run)
+                    putchar(escape);
+                continue;
             }
-
-            if (!is_last_command) 
+            if (*c != '%' || c[1] == '%') 
             {
-                close(next_pipe[0]);
-                dup2(next_pipe[1], STDOUT_FILENO);
-                close(next_pipe[1]);
-            } 
-            else if (line->out_type != OUTPUT_TYPE_STDOUT) 
+                if (!is_dry_run)
+                    putchar(*c);
+                c += *c == '%';
+                continue;
+            }
+            const char* end = c + 1 + strspn(c + 1, "-+ #0");
+            end += strspn(end, "0123456789");
+            if (*end == '.')
+                end += 1 + strspn(end + 1, "0123456789");
+            /* The spec gets "ll", the conversion and 0 appended. */
+            char spec[32];
+            size_t len = end - c;
+            if (len + 4 > sizeof(spec) || *end == 0 || !strchr("scdiuoxX", *end))
+                return false;
+            memcpy(spec, c, len);
+            c = end;
+            const char* arg = next < cmd->arg_count ? cmd->args[next++] : NULL;
+            if (*c == 's' || *c == 'c') 
             {
-                int file_fd;
-                if (!open_fd(&file_fd, line)) 
-                {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(file_fd, STDOUT_FILENO);
-                close(file_fd);
+                spec[len++] = *c;
+                spec[len] = 0;
+                if (is_dry_run)
+                    continue;
+                if (*c == 's')
+                    printf(spec, arg ? arg : "");
+                else
+                    printf(spec, arg ? *arg : 0);
+                continue;
             }
+            if (arg && !printf_is_number(arg, *c))
+                return false;
+            spec[len++] = 'l';
+            spec[len++] = 'l';
+            spec[len++] = *c;
+            spec[len] = 0;
+            if (is_dry_run)
+                continue;
+            if (*c == 'd' || *c == 'i')
+                printf(spec, arg ? strtoll(arg, NULL, 0) : 0ll);
+            else
+                printf(spec, arg ? strtoull(arg, NULL, 0) : 0ull);
+        }
+    } while (next > start && next < cmd->arg_count);
+    return true;
+}
 
-            if (next_pipe[0] != -1)
-                close(next_pipe[0]);
-            if (next_pipe[1] != -1)
-                close(next_pipe[1]);
+static bool printf_is_supported(const struct command* cmd)
+{
+    return cmd->arg_count < 1 ||
+        (cmd->args[0][0] != '-' && printf_format(cmd, true));
+}
 
-            if (!strcmp(head->cmd.exe, "cd")) 
-            {
-                execute_cd(&head->cmd);
-                exit(EXIT_SUCCESS);
-            }
+/** printf format [arguments], see printf_format(). */
+static int execute_printf(const struct command* cmd)
+{
+    assert(cmd);
+    if (cmd->arg_count < 1) 
+    {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    if (!printf_format(cmd, false)) 
+    {
+        fflush(stdout);
+        fprintf(stderr, "printf: %s: unsupported format\n", cmd->args[0]);
+        return 1;
+    }
+    return 0;
+}
 
-            if (!strcmp(head->cmd.exe, "exit")) 
-            {
-                execute_exit(&head->cmd, true);
-                exit(EXIT_SUCCESS);
-            }
+/**
+ * Copy the rest of in_fd to out_fd. Between two files it is done
+ * with copy_file_range() in the kernel, from a file - with
+ * sendfile(), from or to a pipe - with splice(). Only the rest goes
+ * through a buffer.
+ */
+static bool copy_stream(int out_fd, int in_fd)
+{
+    const size_t max_chunk = 1 << 30;
+    struct stat in_st, out_st;
+    bool is_in_stat = fstat(in_fd, &in_st) == 0;
+    bool is_out_stat = fstat(out_fd, &out_st) == 0;
+    bool is_in_file = is_in_stat && S_ISREG(in_st.st_mode);
+    bool is_out_file = is_out_stat && S_ISREG(out_st.st_mode);
+    bool is_in_pipe = is_in_stat && S_ISFIFO(in_st.st_mode);
+    bool is_out_pipe = is_out_stat && S_ISFIFO(out_st.st_mode);
+    ssize_t rc;
+    if (is_in_file && is_out_file) 
+    {
+        while ((rc = copy_file_range(in_fd, NULL, out_fd, NULL, max_chunk, 0)) > 0)
+            ;
+        if (rc == 0)
+            return true;
+        /* O_APPEND, other file systems. */
+        if (errno != EXDEV && errno != EBADF && errno != EINVAL && errno != ENOSYS)
+            return false;
+    }
+    if (is_in_file) 
+    {
+        while ((rc = sendfile(out_fd, in_fd, NULL, max_chunk)) > 0)
+            ;
+        if (rc == 0)
+            return true;
+        if (errno != EINVAL && errno != ENOSYS)
+            return false;
+    }
+    else if (is_in_pipe || is_out_pipe) 
+    {
+        while ((rc = splice(in_fd, NULL, out_fd, NULL, max_chunk, SPLICE_F_MOVE)) > 0)
+            ;
+        if (rc == 0)
+            return true;
+        if (errno != EINVAL && errno != ENOSYS)
+            return false;
+    }
+    char buf[65536];
+    while ((rc = read(in_fd, buf, sizeof(buf))) != 0) 
+    {
+        if (rc < 0) 
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        for (ssize_t done = 0; done < rc;) 
+        {
+            ssize_t written = write(out_fd, buf + done, rc - done);
+            if (written < 0 && errno != EINTR)
+                return false;
+            if (written > 0)
+                done += written;
+        }
+    }
+    return true;
+}
+
+static bool cat_is_supported(const struct command* cmd)
+{
+    for (uint32_t i = 0; i < cmd->arg_count; ++i) 
+    {
+        if (cmd->args[i][0] == '-' && cmd->args[i][1] != 0)
+            return false;
+    }
+    return true;
+}
 
-            char** args = build_args(&head->cmd);
-            execvp(head->cmd.exe, args);
-            perror("execvp");
-            free(args);
-            exit(EXIT_FAILURE);
+static int execute_cat(const struct command* cmd)
+{
+    assert(cmd);
+    fflush(stdout);
+    if (cmd->arg_count == 0)
+        return copy_stream(STDOUT_FILENO, STDIN_FILENO) ? 0 : 1;
+    int status = 0;
+    for (uint32_t i = 0; i < cmd->arg_count; ++i) 
+    {
+        const char* path = cmd->args[i];
+        int fd = STDIN_FILENO;
+        if (strcmp(path, "-") && (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) 
+        {
+            fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+            status = 1;
+            continue;
         }
-        else 
+        if (!copy_stream(STDOUT_FILENO, fd)) 
         {
-            array[child_count++] = pid;
+            fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+            status = 1;
+        }
+        if (fd != STDIN_FILENO)
+            close(fd);
+    }
+    return status;
+}
+
+/**
+ * posix_spawn() the file. One that isn't a binary nor has #! is run
+ * by /bin/sh, like execvp() does it.
+ */
+static int spawn_file(pid_t* pid, const char* path, const posix_spawn_file_actions_t* actions,
+    const posix_spawnattr_t* attr, char** args)
+{
+    int rc = posix_spawn(pid, path, actions, attr, args, environ);
+    if (rc != ENOEXEC)
+        return rc;
+    size_t count = 0;
+    while (args[count])
+        ++count;
+    char** sh_args = (char**) malloc((count + 2) * sizeof(char*));
+    sh_args[0] = (char*) "/bin/sh";
+    sh_args[1] = (char*) path;
+    /* The rest of the arguments with the NULL. */
+    memcpy(sh_args + 2, args + 1, count * sizeof(char*));
+    rc = posix_spawn(pid, "/bin/sh", actions, attr, sh_args, environ);
+    free(sh_args);
+    return rc;
+}
 
-            if (prev_pipe[0] != -1) 
+/**
+ * Start the command with the given stdin and stdout, -1 to keep the
+ * shell's ones. All the other descriptors of the shell must be
+ * close-on-exec, so the child gets only these.
+ *
+ * posix_spawn() doesn't copy the shell's page tables like fork()
+ * does, so its cost doesn't grow with the shell's memory.
+ */
+static pid_t spawn_command(const struct command* cmd, int in_fd, int out_fd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+    /* The shell blocks SIGCHLD, the commands get the usual mask. */
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    char** args = build_args(cmd);
+    pid_t pid;
+    int rc;
+    if (strchr(cmd->exe, '/')) 
+    {
+        rc = spawn_file(&pid, cmd->exe, &actions, &attr, args);
+    }
+    else 
+    {
+        rc = ENOENT;
+        /* A cached file could be gone, then search once more. */
+        for (int attempt = 0; attempt < 2 && (rc == ENOENT || rc == ENOTDIR); ++attempt) 
+        {
+            if (attempt > 0)
+                path_cache_forget(cmd->exe);
+            struct path_entry* entry = path_cache_lookup(cmd->exe);
+            if (!entry) 
             {
-                close(prev_pipe[0]);
-                close(prev_pipe[1]);
+                rc = ENOENT;
+                break;
             }
+            rc = spawn_file(&pid, entry->path, &actions, &attr, args);
+            if (rc == 0)
+                ++entry->hits;
+        }
+    }
+    free(args);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (rc != 0) 
+    {
+        fprintf(stderr, "%s: %s\n", cmd->exe, strerror(rc));
+        return -1;
+    }
+    return pid;
+}
 
-            if (!is_last_command) 
-            {
-                prev_pipe[0] = next_pipe[0];
-                prev_pipe[1] = next_pipe[1];
-            } 
-            else 
+static int execute_command_line(const struct command_line* line);
+static int execute_parallel(const struct command* cmd);
+
+/**
+ * Commands run by the shell without exec(). A whole pipeline of one
+ * such command runs in the shell process when it can, otherwise the
+ * builtin runs in a forked child.
+ */
+struct builtin
+{
+    const char* name;
+    int (*run)(const struct command* cmd);
+    /** False for the ones reading the shell's stdin. */
+    bool is_in_shell;
+    /**
+     * The builtin knows only some options. The command with others
+     * runs the program from PATH. NULL - takes any arguments.
+     */
+    bool (*is_supported)(const struct command* cmd);
+};
+
+static const struct builtin builtins[] = {
+    {"cd", execute_cd, true, NULL},
+    {"exit", execute_exit, true, NULL},
+    {"hash", execute_hash, true, NULL},
+    {"wait", execute_wait, true, NULL},
+    {"echo", execute_echo, true, echo_is_supported},
+    {"true", execute_true, true, NULL},
+    {"false", execute_false, true, NULL},
+    {"pwd", execute_pwd, true, NULL},
+    {"printf", execute_printf, true, printf_is_supported},
+    {"cat", execute_cat, true, cat_is_supported},
+    {"parallel", execute_parallel, false, NULL},
+};
+
+static const struct builtin* find_builtin(const struct command* cmd)
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) 
+    {
+        const struct builtin* builtin = &builtins[i];
+        if (strcmp(builtin->name, cmd->exe))
+            continue;
+        if (builtin->is_supported && !builtin->is_supported(cmd))
+            return NULL;
+        return builtin;
+    }
+    return NULL;
+}
+
+/** A builtin in a pipeline runs in a child, like bash does. */
+static pid_t fork_builtin(const struct command* cmd, int in_fd, int out_fd)
+{
+    const struct builtin* builtin = find_builtin(cmd);
+    assert(builtin);
+    /* The child must not print what the shell has buffered. */
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) 
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid > 0)
+        return pid;
+    if (in_fd >= 0)
+        dup2(in_fd, STDIN_FILENO);
+    if (out_fd >= 0)
+        dup2(out_fd, STDOUT_FILENO);
+    /*
+     * No exec closes the O_CLOEXEC ones here. The read end of the
+     * own output pipe would keep a write blocked after the reader
+     * exits.
+     */
+    close_range(STDERR_FILENO + 1, ~0U, 0);
+    int status = builtin->run(cmd);
+    fflush(stdout);
+    _exit(status);
+}
+
+static int wait_status(pid_t pid)
+{
+    if (pid < 0)
+        return 1;
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+/**
+ * Run a builtin in the shell itself, with the given stdout for the
+ * time of the call. -1 keeps the shell's one.
+ */
+static int execute_builtin_here(const struct command* cmd, int out_fd, int (*builtin)(const struct command*))
+{
+    int saved_fd = -1;
+    if (out_fd >= 0) 
+    {
+        fflush(stdout);
+        saved_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        dup2(out_fd, STDOUT_FILENO);
+    }
+    int status = builtin(cmd);
+    /* The children write into the descriptor, keep the order. */
+    fflush(stdout);
+    if (saved_fd >= 0) 
+    {
+        dup2(saved_fd, STDOUT_FILENO);
+        close(saved_fd);
+    }
+    return status;
+}
+
+/** The expr after the pipeline: && or || or NULL. */
+static const struct expr* pipeline_end(const struct expr* head)
+{
+    while (head && head->type != EXPR_TYPE_AND && head->type != EXPR_TYPE_OR)
+        head = head->next;
+    return head;
+}
+
+/**
+ * Start all the commands of the pipeline beginning at the head. The
+ * last one writes into out_fd. Returns the array of their pids, -1
+ * for the ones failed to start.
+ */
+static pid_t* start_pipeline(const struct expr* head, int out_fd, size_t* count)
+{
+    size_t child_count = 0, array_size = 32;
+    int in_fd = -1;
+
+    pid_t* array = (pid_t*) malloc(array_size * sizeof(pid_t));
+    if (!array) 
+    {
+        perror("malloc");
+        *count = 0;
+        return NULL;
+    }
+
+    while (head && head->type == EXPR_TYPE_COMMAND) 
+    {
+        int next_pipe[SIZEOF_PIPE] = {-1, -1};
+        bool is_last_command = !head->next || head->next->type != EXPR_TYPE_PIPE;
+
+        /* Before the pipe is made, so a failure has nothing to leak. */
+        if (child_count >= array_size) 
+        {
+            array_size *= 2;
+            pid_t* new_array = (pid_t*) realloc(array, array_size * sizeof(pid_t));
+            if (!new_array) 
             {
-                if (next_pipe[0] != -1)
-                    close(next_pipe[0]);
-                if (next_pipe[1] != -1)
-                    close(next_pipe[1]);
+                perror("realloc");
+                break;
             }
+            array = new_array;
+        }
 
-            head = is_last_command ? NULL : head->next->next;
+        if (!is_last_command && pipe2(next_pipe, O_CLOEXEC) < 0) 
+        {
+            perror("pipe");
+            break;
+        }
+        if (!is_last_command && pipe_size > 0 &&
+            fcntl(next_pipe[1], F_SETPIPE_SZ, pipe_size) < 0) 
+        {
+            /* Above /proc/sys/fs/pipe-max-size, keep the default. */
+            perror("MYBASH_PIPE_SIZE");
+            pipe_size = 0;
         }
+
+        int stage_out_fd = is_last_command ? out_fd : next_pipe[1];
+        if (find_builtin(&head->cmd))
+            array[child_count++] = fork_builtin(&head->cmd, in_fd, stage_out_fd);
+        else
+            array[child_count++] = spawn_command(&head->cmd, in_fd, stage_out_fd);
+
+        if (in_fd != -1)
+            close(in_fd);
+        if (next_pipe[1] != -1)
+            close(next_pipe[1]);
+        in_fd = next_pipe[0];
+
+        head = is_last_command ? NULL : head->next->next;
     }
 
-    if (prev_pipe[0] != -1)
-        close(prev_pipe[0]);
-    if (prev_pipe[1] != -1)
-        close(prev_pipe[1]);
+    if (in_fd != -1)
+        close(in_fd);
+    *count = child_count;
+    return array;
+}
 
-    if (line->is_background)
+/** Run the pipeline beginning at the head and wait for it. */
+static int execute_pipeline(const struct expr* head, int out_fd)
+{
+    assert(head);
+    if (!head->next || head->next->type != EXPR_TYPE_PIPE) 
     {
-        free(array);
-        return 0;
+        const struct builtin* builtin = find_builtin(&head->cmd);
+        if (builtin && builtin->is_in_shell)
+            return execute_builtin_here(&head->cmd, out_fd, builtin->run);
     }
 
+    size_t child_count;
+    pid_t* array = start_pipeline(head, out_fd, &child_count);
+    int exit_status = 1;
     for (size_t i = 0; i < child_count; ++i)
     {
-        waitpid(array[i], &status, 0);
+        int status = wait_status(array[i]);
         if (i == child_count - 1)
-            exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+            exit_status = status;
     }
-
     free(array);
     return exit_status;
 }
 
-static int execute_command_line(const struct command_line* line)
+/**
+ * Run the pipelines of the line one by one. && and || have the same
+ * priority and go left to right, a pipeline is skipped when the
+ * status so far already decides the result. The output redirect
+ * belongs to the last pipeline.
+ */
+static int execute_logic(const struct command_line* line)
 {
     assert(line);
-    assert(line->head);
-
-    if (line->head->next && line->head->next->type == EXPR_TYPE_PIPE)
-        return execute_pipeline(line);
-
-    if (line->head->type == EXPR_TYPE_COMMAND) 
+    int exit_status = 0;
+    const struct expr* head = line->head;
+    while (head) 
     {
-        const struct command* cmd = &line->head->cmd;
-
-        if (!strcmp(cmd->exe, "cd")) 
+        const struct expr* end = pipeline_end(head);
+        int fd = -1;
+        if (!end && line->out_type != OUTPUT_TYPE_STDOUT && !open_fd(&fd, line)) 
         {
-            execute_cd(cmd);
-            return 0;
+            perror("open");
+            return 1;
         }
+        exit_status = execute_pipeline(head, fd);
+        if (fd != -1)
+            close(fd);
 
-        if (!strcmp(cmd->exe, "exit")) 
-        {
-            execute_exit(cmd, false);
-            return 0;
-        }
+        while (end && (end->type == EXPR_TYPE_AND) != (exit_status == 0))
+            end = pipeline_end(end->next);
+        head = end ? end->next : NULL;
+    }
+    return exit_status;
+}
 
+/**
+ * Start the line as a job. A single pipeline is started right away.
+ * A line with && or || is run by a forked copy of the shell, and so
+ * is a redirected one - opening a FIFO blocks until it has a reader.
+ */
+static int execute_background(const struct command_line* line)
+{
+    assert(line);
+    size_t pid_count;
+    pid_t* pids;
+    if (!pipeline_end(line->head) && line->out_type == OUTPUT_TYPE_STDOUT) 
+    {
+        pids = start_pipeline(line->head, -1, &pid_count);
+    }
+    else 
+    {
+        fflush(stdout);
         pid_t pid = fork();
         if (pid < 0) 
         {
             perror("fork");
             return 1;
         }
-        else if (pid == 0) 
+        if (pid == 0) 
         {
-            int fd = STDOUT_FILENO;
+            /* The jobs of the shell are not children of the copy. */
+            jobs_clear();
+            int status = execute_logic(line);
+            fflush(stdout);
+            _exit(status);
+        }
+        pids = (pid_t*) malloc(sizeof(pid_t));
+        pids[0] = pid;
+        pid_count = 1;
+    }
+    if (pids)
+        jobs_add(pids, pid_count);
+    return 0;
+}
 
-            if (line->out_type != OUTPUT_TYPE_STDOUT) 
-            {
-                if (!open_fd(&fd, line)) 
-                {
-                    perror("open");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
-            }
+static int execute_command_line(const struct command_line* line)
+{
+    assert(line);
+    assert(line->head);
 
-            char** args = build_args(cmd);
-            execvp(cmd->exe, args);
-            perror("execvp error");
-            free(args);
-            exit(EXIT_FAILURE);
-        }
-        else 
-        {
-            if (line->is_background)
-                return 0;
+    if (line->is_background)
+        return execute_background(line);
+    return execute_logic(line);
+}
 
-            int status;
-            waitpid(pid, &status, 0);
+/**
+ * parallel [-j N] runs the lines read from stdin, up to N at once,
+ * by default one per CPU. The stdout of each job goes into a memfd
+ * and is printed whole when the job ends, so the outputs don't
+ * interleave. They come in the order of completion, like the default
+ * grouping of GNU parallel, and only the running jobs hold a memfd.
+ * The jobs read /dev/null, the job list is parallel's own stdin.
+ * The status is the number of failed jobs, 101 if more than 100,
+ * like GNU parallel has.
+ */
+struct parallel_job
+{
+    pid_t pid;
+    int out_fd;
+};
 
-            return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
-        }
+struct parallel
+{
+    /** The running jobs, in no particular order. */
+    struct parallel_job* jobs;
+    size_t count;
+    size_t capacity;
+    size_t failed;
+};
+
+/** Print the output of the ended job and forget it. */
+static void parallel_finish(struct parallel* par, size_t index, int status)
+{
+    struct parallel_job* job = &par->jobs[index];
+    lseek(job->out_fd, 0, SEEK_SET);
+    copy_stream(STDOUT_FILENO, job->out_fd);
+    close(job->out_fd);
+    if (status != 0)
+        ++par->failed;
+    *job = par->jobs[--par->count];
+}
+
+static void parallel_wait_one(struct parallel* par)
+{
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) 
+    {
+        if (errno == EINTR)
+            return;
+        /* Nothing to wait for, the jobs are lost. */
+        while (par->count > 0)
+            parallel_finish(par, par->count - 1, 1);
+        return;
     }
+    for (size_t i = 0; i < par->count; ++i) 
+    {
+        if (par->jobs[i].pid != pid)
+            continue;
+        parallel_finish(par, i, WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+        return;
+    }
+}
 
-    return 0;
+static void parallel_start(struct parallel* par, const struct command_line* line)
+{
+    int out_fd = memfd_create("parallel", MFD_CLOEXEC);
+    if (out_fd < 0) 
+    {
+        perror("memfd_create");
+        ++par->failed;
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) 
+    {
+        perror("fork");
+        close(out_fd);
+        ++par->failed;
+        return;
+    }
+    if (pid == 0) 
+    {
+        int in_fd = open("/dev/null", O_RDONLY);
+        if (in_fd >= 0) 
+        {
+            dup2(in_fd, STDIN_FILENO);
+            close(in_fd);
+        }
+        dup2(out_fd, STDOUT_FILENO);
+        int status = execute_command_line(line);
+        fflush(stdout);
+        _exit(status);
+    }
+    if (par->count == par->capacity) 
+    {
+        par->capacity = par->capacity == 0 ? 16 : par->capacity * 2;
+        par->jobs = (struct parallel_job*) realloc(par->jobs, par->capacity * sizeof(*par->jobs));
+    }
+    par->jobs[par->count++] = (struct parallel_job) {pid, out_fd};
 }
 
-int main(void)
+static int execute_parallel(const struct command* cmd)
 {
-    const size_t buf_size = 1024;
-    char buf[buf_size];
-    int rc, exit_status = 0;
-    struct parser* p = parser_new();
+    assert(cmd);
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    for (uint32_t i = 0; i < cmd->arg_count; ++i) 
+    {
+        const char* value = NULL;
+        if (!strcmp(cmd->args[i], "-j") && i + 1 < cmd->arg_count)
+            value = cmd->args[++i];
+        else if (!strncmp(cmd->args[i], "-j", 2))
+            value = cmd->args[i] + 2;
+        char* end = NULL;
+        if (value)
+            limit = strtol(value, &end, 10);
+        if (!value || *value == 0 || *end != 0 || limit <= 0) 
+        {
+            fprintf(stderr, "parallel: usage: parallel [-j N]\n");
+            return 2;
+        }
+    }
+    if (limit <= 0)
+        limit = 1;
 
-    while ((rc = read(STDIN_FILENO, buf, buf_size)) >= 0) 
+    /* The shell's jobs are not children of this process. */
+    jobs_clear();
+    struct parallel par = {NULL, 0, 0, 0};
+    struct parser* p = parser_new();
+    char buf[4096];
+    ssize_t rc;
+    do 
     {
-        parser_feed(p, buf, rc);
+        rc = read(STDIN_FILENO, buf, sizeof(buf));
+        if (rc < 0 && errno == EINTR)
+            continue;
+        parser_feed(p, buf, rc > 0 ? rc : 0);
         struct command_line* line = NULL;
         while (true) 
         {
             enum parser_error err = parser_pop_next(p, &line);
             if (err == PARSER_ERR_NONE && line == NULL)
                 break;
-
             if (err != PARSER_ERR_NONE) 
             {
                 fprintf(stderr, "Error: %d\n", (int)err);
+                ++par.failed;
                 continue;
             }
-
-            exit_status = execute_command_line(line);
+            while (par.count >= (size_t)limit)
+                parallel_wait_one(&par);
+            parallel_start(&par, line);
             command_line_delete(line);
         }
+    } while (rc > 0 || (rc < 0 && errno == EINTR));
+    parser_delete(p);
+
+    while (par.count > 0)
+        parallel_wait_one(&par);
+    free(par.jobs);
+    return par.failed > 100 ? 101 : (int)par.failed;
+}
+
+static void execute_lines(struct parser* p, int* exit_status)
+{
+    struct command_line* line = NULL;
+    while (true) 
+    {
+        enum parser_error err = parser_pop_next(p, &line);
+        if (err == PARSER_ERR_NONE && line == NULL)
+            break;
+
+        if (err != PARSER_ERR_NONE) 
+        {
+            fprintf(stderr, "Error: %d\n", (int)err);
+            continue;
+        }
+
+        *exit_status = execute_command_line(line);
+        command_line_delete(line);
+        jobs_reap_if_signaled();
+    }
+}
+
+/**
+ * Run a script file. It is mapped and parsed in place, so a big
+ * script is never copied.
+ */
+static bool execute_script(struct parser* p, const char* path, int* exit_status)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) 
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    if (size == 0) 
+    {
+        close(fd);
+        return true;
+    }
+    char* data = (char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    const size_t max_piece = 1 << 30;
+    for (size_t pos = 0; pos < size; pos += max_piece) 
+    {
+        size_t piece = size - pos < max_piece ? size - pos : max_piece;
+        parser_feed_view(p, data + pos, piece);
+        execute_lines(p, exit_status);
+    }
+    munmap(data, size);
+    return true;
+}
+
+static int parse_pipe_size(const char* str)
+{
+    char* end;
+    errno = 0;
+    long size = strtol(str, &end, 10);
+    int shift = 0;
+    if (*end == 'k' || *end == 'K')
+        shift = 10, ++end;
+    else if (*end == 'm' || *end == 'M')
+        shift = 20, ++end;
+    /* Checked before the shift, which can't take a negative nor overflow. */
+    if (errno != 0 || end == str || *end != 0 || size <= 0 || size > (1 << 30) >> shift) 
+    {
+        fprintf(stderr, "MYBASH_PIPE_SIZE: bad size '%s'\n", str);
+        return 0;
+    }
+    return size << shift;
+}
+
+int main(int argc, char** argv)
+{
+    int exit_status = 0;
+    struct parser* p = parser_new();
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    const char* pipe_size_env = getenv("MYBASH_PIPE_SIZE");
+    if (pipe_size_env)
+        pipe_size = parse_pipe_size(pipe_size_env);
+
+    if (argc > 1) 
+    {
+        if (!execute_script(p, argv[1], &exit_status)) 
+        {
+            perror(argv[1]);
+            exit_status = 127;
+        }
+        parser_delete(p);
+        exit(exit_status);
+    }
+
+    const size_t buf_size = 1024;
+    char buf[buf_size];
+    int rc;
+    struct pollfd fds[2] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {sigchld_fd, POLLIN, 0},
+    };
+    while (true) 
+    {
+        /* Reap the jobs finished while waiting for the next line. */
+        if (job_count > 0 && sigchld_fd >= 0) 
+        {
+            if (poll(fds, 2, -1) < 0 && errno != EINTR)
+                break;
+            if (fds[1].revents != 0)
+                jobs_reap_if_signaled();
+            if (fds[0].revents == 0)
+                continue;
+        }
+        if ((rc = read(STDIN_FILENO, buf, buf_size)) < 0)
+            break;
+        parser_feed(p, buf, rc);
+        execute_lines(p, &exit_status);
 
         if (rc == 0)
             break;
     }
 
     parser_delete(p);
+    path_cache_clear();
+    jobs_clear();
+    free(jobs);
     exit(exit_status);
-}
\ No newline at end of file
+}